@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>             // for variadic functions in testing
+#include <limits.h>
+#include <stdint.h>
 
 #define MAX_CANDIDATES 128
 #define MAX_NAME       128
@@ -13,6 +15,7 @@
 typedef struct vote_node {             // Vote data type: single voter preferences of candidates
   int id;                              // ID of the ballot for this vote
   int pos;                             // index of currently selected candidate
+  int weight;                          // identical ballots this vote stands for, 1 unless pre-aggregated
   int candidate_order[MAX_CANDIDATES]; // array of candidate preferences for this vote
   struct vote_node *next;              // pointer to the next vote in a list of votes or NULL
 } vote_t;
@@ -21,12 +24,162 @@ typedef struct {                                  // Tally data type: votes asso
   int candidate_count;                            // total candidates in the election, length of various arrays below
   char candidate_names[MAX_CANDIDATES][MAX_NAME]; // names of each candidate
   char candidate_status[MAX_CANDIDATES];          // flags for each candidate, on of UNKNOWN, LIVE, DROPPED
-  int candidate_vote_counts[MAX_CANDIDATES];      // length of vot lists associated with each candidate
+  int candidate_vote_counts[MAX_CANDIDATES];      // summed weights of vote lists associated with each candidate
   vote_t *candidate_votes[MAX_CANDIDATES];        // pointers linked lists of votes for each candidate
   vote_t *invalid_votes;                          // list of votes that are invalid: no live candidate is ranked
-  int invalid_vote_count;                         // length of invalid_vote list
+  int invalid_vote_count;                         // summed weights of invalid_vote list
 } tally_t;
 
+typedef struct {                      // Snapshot of the election state of a tally, see tally_snapshot_r()
+  tally_t *tally;                     // tally the snapshot was taken of
+  char candidate_status[MAX_CANDIDATES];     // saved candidate statuses
+  int candidate_vote_counts[MAX_CANDIDATES]; // saved vote counts
+  int invalid_vote_count;             // saved invalid vote count
+  int list_starts[MAX_CANDIDATES + 2];// offset in votes[] of each candidate's list; list candidate_count is invalid votes
+  vote_t **votes;                     // every vote in list order
+  int *pos;                           // saved pos field of each vote in votes[]
+  int vote_count;                     // length of votes[] and pos[]
+} tally_snapshot_t;
+
+// REASONS a ballot read from a vote file fails validation, see tally_read_vote_r()
+#define BALLOT_OK        0       // every ranking is a candidate or NO_CANDIDATE, none repeated
+#define BALLOT_RANGE     1       // a ranking is not a candidate index
+#define BALLOT_DUPLICATE 2       // a candidate is ranked twice
+#define BALLOT_SHORT     3       // the file ends part way through the ballot
+#define BALLOT_STRAY     4       // a token is not an integer
+#define BALLOT_LONG      5       // a line has more rankings than candidates, in line mode
+#define BALLOT_WEIGHT    6       // a weight prefix N: is not a positive integer
+#define BALLOT_REASONS   7
+
+// POLICY for ballots failing validation, rcv_ctx_t.validate
+#define RCV_VALIDATE_INVALID 0   // clear the rankings so the ballot is an invalid vote
+#define RCV_VALIDATE_SKIP    1   // leave the ballot out of the tally
+#define RCV_VALIDATE_REJECT  2   // refuse to load the file
+
+typedef struct {                      // Stats accumulated in an election context
+  long votes_added;                   // votes added to tallies via tally_add_vote_r()
+  long votes_transferred;             // votes moved between candidates during rounds
+  int candidates_dropped;             // candidates changed from MINVOTES to DROPPED
+  int rounds;                         // rounds run by the last tally_election_r()
+  int winner;                         // winner index of the last election or NO_CANDIDATE
+  long bad_ballots[BALLOT_REASONS];   // ballots failing validation while read, by BALLOT_* reason
+  long lines;                         // lines read of the vote file being loaded
+} rcv_stats_t;
+
+#define RCV_MAX_HOOKS 8                // round hooks that may be registered in one context
+
+typedef struct rcv_ctx rcv_ctx_t;
+typedef void (*rcv_round_fn)(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg);
+typedef void (*rcv_transfer_fn)(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote, int from, int to, void *arg);
+
+struct rcv_ctx {                      // Election context: per-contest settings replacing process globals
+  int log_level;                      // verbosity, compared against the LOG_* values below
+  FILE *out;                          // sink for all printed output, stdout by default
+  void *(*alloc)(size_t size);        // allocator for votes and tallies, malloc() by default
+  void (*dealloc)(void *ptr);         // de-allocator matching alloc, free() by default
+  int validate;                       // RCV_VALIDATE_* policy for bad ballots, invalid by default
+  int line_mode;                      // read one ballot per line of any length, see tally_read_vote_r()
+  rcv_stats_t stats;                  // counters updated while loading and tabulating
+  rcv_round_fn round_hooks[RCV_MAX_HOOKS]; // called at the end of each election round
+  void *round_hook_args[RCV_MAX_HOOKS];    // argument passed to each round hook
+  int round_hook_count;               // number of registered round hooks
+  rcv_transfer_fn transfer_hooks[RCV_MAX_HOOKS]; // called for every vote moved between candidates
+  void *transfer_hook_args[RCV_MAX_HOOKS]; // argument passed to each transfer hook
+  int transfer_hook_count;            // number of registered transfer hooks
+};
+
+typedef struct {                      // One contest in a batch run, see rcv_batch.c
+  char fname[PATH_MAX];               // vote file for the contest
+  char outname[PATH_MAX];             // output file when written to an output directory
+  char *output;                       // buffered output when no output directory is given
+  size_t output_len;                  // length of buffered output
+  int candidate_count;                // candidates in the contest
+  long votes;                         // votes loaded
+  int condition;                      // final TALLY_* condition of the election
+  int winner;                         // winner index or NO_CANDIDATE
+  int rounds;                         // rounds needed to finish
+  double load_secs;                   // time to load the vote file
+  double tally_secs;                  // time to run the election
+  char message[MAX_NAME + 64];        // one-line result for the summary
+} rcv_contest_t;
+
+typedef struct {                      // Incremental tabulation state, see rcv_incr.c
+  char fname[PATH_MAX];               // vote file which is appended to
+  long offset;                        // bytes of the vote file parsed so far
+  int vote_count;                     // votes parsed so far, ids are 1..vote_count
+  tally_t *tally;                     // all votes in the state left by the last run
+  int rounds;                         // rounds in the history below
+  int condition;                      // final condition of the last run
+  int replay_round;                   // first round re-run by the last update, 0 if none were
+  int (*round_counts)[MAX_CANDIDATES];   // [round][cand] counts at the end of each round
+  char (*round_dropped)[MAX_CANDIDATES]; // [round][cand] dropped before the round's counts
+  char (*round_marks)[MAX_CANDIDATES];   // [round][cand] marked MINVOTES at the end of the round
+  int *round_invalid;                 // [round] invalid votes at the end of each round
+} rcv_incr_t;
+
+typedef struct rcv_audit rcv_audit_t;  // Binary transfer audit log, see rcv_audit.c
+typedef struct rcv_checkpoint rcv_checkpoint_t;  // Per-round election checkpoints, see rcv_checkpoint.c
+
+typedef struct {                      // Per-round transfer report, see rcv_transfer.c
+  int candidate_count;                // candidates in the election
+  int format;                         // RCV_TRANSFERS_CSV or RCV_TRANSFERS_JSON
+  FILE *out;                          // where rows are written at the end of each round
+  long *counts;                       // [from][to] votes moved this round, column candidate_count is exhausted
+  char dropped[MAX_CANDIDATES];       // candidates whose rows have been written
+  int rows_written;                   // rows output so far
+} rcv_transfers_t;
+
+typedef struct {                      // Read-only ballots shared by simulations, see rcv_sim.c
+  int candidate_count;                // candidates ranked on the ballots
+  int ballot_count;                   // length of ballots[]
+  vote_t **ballots;                   // every vote in id order, only candidate_order[] is read
+} rcv_ballots_t;
+
+typedef struct {                      // Result of one simulated election, see rcv_sim_run()
+  int condition;                      // final TALLY_* condition
+  int winner;                         // winner index or NO_CANDIDATE
+  int rounds;                         // rounds run
+  int final_counts[MAX_CANDIDATES];   // counts at the end of the last round
+  char final_status[MAX_CANDIDATES];  // statuses at the end of the last round
+  int (*round_counts)[MAX_CANDIDATES];   // optional [round][cand] counts of each round
+  char (*round_status)[MAX_CANDIDATES];  // optional [round][cand] statuses after each round's MINVOTES marking
+} rcv_sim_result_t;
+
+typedef struct rcv_live rcv_live_t;  // Live tabulation of a growing vote stream, see rcv_live.c
+
+typedef struct {                      // Result published by a live tabulation, see rcv_live_latest()
+  long seq;                           // results published so far, 0 before the first
+  long ballots;                       // ballots the result counts
+  int candidate_count;                // candidates in the election
+  int first_counts[MAX_CANDIDATES];   // first choice counts of those ballots
+  int invalid;                        // those ballots with no valid first choice
+  rcv_sim_result_t sim;               // full election on those ballots, round counts are below
+  int round_counts[MAX_CANDIDATES + 1][MAX_CANDIDATES]; // [round][cand] counts of each round
+  double secs;                        // time taken to run the election
+} rcv_live_result_t;
+
+typedef struct rcv_shm rcv_shm_t;    // Round table publication in shared memory, see rcv_shm.c
+
+typedef struct {                      // Round table as published in shared memory, see rcv_shm.c
+  uint64_t seq;                       // update counter, odd while an update is being written
+  uint32_t magic;                     // set once anything has been published
+  int candidate_count;                // candidates in the election
+  int round;                          // round the table is the end of, 0 when just loaded
+  int condition;                      // TALLY_* condition after the round
+  int winner;                         // winner index or NO_CANDIDATE
+  int invalid_vote_count;             // invalid votes after the round
+  int counts[MAX_CANDIDATES];         // vote counts after the round
+  char status[MAX_CANDIDATES];        // statuses after the round's MINVOTES marking
+  char names[MAX_CANDIDATES][MAX_NAME]; // candidate names
+} rcv_shm_table_t;
+
+typedef struct {                      // Streaming SHA-256 state, see rcv_sha256_init()
+  uint32_t h[8];                      // hash of the whole blocks so far
+  uint64_t len;                       // bytes hashed so far
+  uint8_t buf[64];                    // partial block not yet hashed
+  size_t used;                        // bytes in buf
+} rcv_sha256_t;
+
 #define NO_CANDIDATE   -1       // used to indicate no preference of candidate in vote->candidate_order[]
 
 // STATUS of candidates in an election
@@ -41,7 +194,7 @@ typedef struct {                                  // Tally data type: votes asso
 #define TALLY_TIE      3         // an all-way tie which ends the election
 #define TALLY_CONTINUE 4         // another round can be applied ot the tally
 
-// Values for the LOG_LEVEL global variable to trigger verbose printing of log messages
+// Values for the LOG_LEVEL global variable / rcv_ctx_t.log_level to trigger verbose printing of log messages
 #define LOG_DROP_MINVOTES  1
 #define LOG_MINVOTE        2
 #define LOG_SHOWVOTES      3
@@ -50,6 +203,10 @@ typedef struct {                                  // Tally data type: votes asso
 
 // rcv_funcs.c
 extern int LOG_LEVEL;
+void rcv_ctx_init(rcv_ctx_t *ctx);
+rcv_ctx_t rcv_ctx_global();
+int rcv_ctx_add_round_hook(rcv_ctx_t *ctx, rcv_round_fn fn, void *arg);
+int rcv_ctx_add_transfer_hook(rcv_ctx_t *ctx, rcv_transfer_fn fn, void *arg);
 void vote_print(vote_t *vote);
 int vote_next_candidate(vote_t *vote, char *candidate_status);
 void tally_print_table(tally_t *tally);
@@ -63,3 +220,135 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index);
 void tally_drop_minvote_candidates(tally_t *tally);
 void tally_election(tally_t *tally);
 tally_t *tally_from_file(char *fname);
+tally_snapshot_t *tally_snapshot(tally_t *tally);
+void tally_restore(tally_snapshot_t *snap);
+void tally_snapshot_free(tally_snapshot_t *snap);
+
+// rcv_funcs.c reentrant versions taking an election context
+void vote_print_r(rcv_ctx_t *ctx, vote_t *vote);
+void tally_print_table_r(rcv_ctx_t *ctx, tally_t *tally);
+void tally_set_minvote_candidates_r(rcv_ctx_t *ctx, tally_t *tally);
+vote_t *vote_make_empty_r(rcv_ctx_t *ctx);
+void tally_add_vote_r(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote);
+void tally_print_votes_r(rcv_ctx_t *ctx, tally_t *tally);
+void tally_free_r(rcv_ctx_t *ctx, tally_t *tally);
+void tally_transfer_first_vote_r(rcv_ctx_t *ctx, tally_t *tally, int candidate_index);
+void tally_drop_minvote_candidates_r(rcv_ctx_t *ctx, tally_t *tally);
+int tally_election_r(rcv_ctx_t *ctx, tally_t *tally);
+int tally_election_resume_r(rcv_ctx_t *ctx, tally_t *tally, int round);
+int tally_print_result_r(rcv_ctx_t *ctx, tally_t *tally);
+tally_t *tally_from_file_r(rcv_ctx_t *ctx, char *fname);
+tally_t *tally_from_stream_r(rcv_ctx_t *ctx, FILE *file, char *fname);
+void tally_read_header_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, char *fname);
+int tally_read_votes_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, char *fname, int first_id);
+int vote_check_ranking(int value, int candidate_count, uint64_t *seen);
+int tally_read_vote_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, vote_t *vote, long *line);
+int tally_screen_vote_r(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote, int reason, char *fname, long line);
+long tally_ballots_read(rcv_ctx_t *ctx);
+void tally_print_bad_ballots_r(rcv_ctx_t *ctx);
+tally_snapshot_t *tally_snapshot_r(rcv_ctx_t *ctx, tally_t *tally);
+void tally_restore_r(rcv_ctx_t *ctx, tally_snapshot_t *snap);
+void tally_snapshot_free_r(rcv_ctx_t *ctx, tally_snapshot_t *snap);
+
+// rcv_pool.c
+typedef void (*rcv_task_fn)(void *arg, int task_index, int worker);
+int rcv_pool_threads();
+int rcv_pool_run(int nthreads, int ntasks, rcv_task_fn fn, void *arg);
+
+// rcv_batch.c
+double rcv_now();
+int rcv_batch_collect_r(rcv_ctx_t *ctx, char *path, rcv_contest_t **contests);
+int rcv_batch_run(rcv_contest_t *contests, int count, int log_level, char *outdir, int nthreads);
+void rcv_batch_print_summary(FILE *out, rcv_contest_t *contests, int count, int nthreads, double total_secs);
+void rcv_batch_free(rcv_contest_t *contests, int count);
+
+// rcv_shard.c
+tally_t *tally_from_shards_r(rcv_ctx_t *ctx, char **fnames, int count, int nthreads);
+tally_t *tally_from_shards(char **fnames, int count);
+
+// rcv_incr.c
+rcv_incr_t *rcv_incr_open_r(rcv_ctx_t *ctx, char *fname);
+int rcv_incr_update_r(rcv_ctx_t *ctx, rcv_incr_t *incr);
+void rcv_incr_free_r(rcv_ctx_t *ctx, rcv_incr_t *incr);
+
+// rcv_sim.c
+void rcv_ballots_init(rcv_ballots_t *ballots, tally_t *tally);
+int rcv_ballots_find(const rcv_ballots_t *ballots, int id);
+void rcv_ballots_free(rcv_ballots_t *ballots);
+void rcv_ballots_print_aggregated_r(rcv_ctx_t *ctx, tally_t *tally);
+int rcv_sim_run(const rcv_ballots_t *ballots, const char *init_status, const int *weights,
+                rcv_sim_result_t *result, int *scratch);
+
+// rcv_sample.c
+#define RCV_SAMPLE_BOOTSTRAP 1          // resample all ballots with replacement
+#define RCV_SAMPLE_SUBSET    2          // sample a fraction of ballots without replacement
+void rcv_montecarlo_r(rcv_ctx_t *ctx, tally_t *tally, int samples, int mode,
+                      double fraction, uint64_t seed, int nthreads);
+
+// rcv_margin.c
+void rcv_margins_r(rcv_ctx_t *ctx, tally_t *tally, int exhaustive, int nthreads);
+
+// rcv_pairwise.c
+long *rcv_pairwise(const rcv_ballots_t *ballots, const int *weights, int nthreads);
+int rcv_condorcet_winner(const long *matrix, int n);
+void rcv_pairwise_print_r(rcv_ctx_t *ctx, tally_t *tally, int nthreads);
+
+// rcv_transfer.c
+#define RCV_TRANSFERS_CSV  1
+#define RCV_TRANSFERS_JSON 2
+rcv_transfers_t *rcv_transfers_open_r(rcv_ctx_t *ctx, tally_t *tally, FILE *out, int format);
+void rcv_transfers_close_r(rcv_ctx_t *ctx, rcv_transfers_t *tr);
+
+// rcv_audit.c
+rcv_audit_t *rcv_audit_open_r(rcv_ctx_t *ctx, char *fname, int first_round);
+int rcv_audit_close_r(rcv_ctx_t *ctx, rcv_audit_t *audit);
+int rcv_audit_print_r(rcv_ctx_t *ctx, char *fname, tally_t *tally, int id, int cand);
+
+// rcv_decision.c
+int rcv_decisions_write_r(rcv_ctx_t *ctx, tally_t *tally, char *fname);
+int rcv_decisions_verify_r(rcv_ctx_t *ctx, tally_t *tally, char *fname, int nthreads);
+
+// rcv_checkpoint.c
+rcv_checkpoint_t *rcv_checkpoint_open_r(rcv_ctx_t *ctx, tally_t *tally, char *fname, int *resume_round);
+int rcv_checkpoint_close_r(rcv_ctx_t *ctx, rcv_checkpoint_t *ckpt);
+
+// rcv_ooc.c
+int rcv_ooc_election_r(rcv_ctx_t *ctx, char *fname, long budget, char *tmpdir);
+
+// rcv_input.c
+FILE *rcv_input_open(char *fname);
+
+// rcv_cvr.c
+tally_t *tally_from_cvr_r(rcv_ctx_t *ctx, char *fname);
+
+// rcv_live.c
+rcv_live_t *rcv_live_open_r(rcv_ctx_t *ctx, char *fname, int interval_ms, int follow);
+int rcv_live_run_r(rcv_ctx_t *ctx, rcv_live_t *live);
+long rcv_live_latest(rcv_live_t *live, rcv_live_result_t *result);
+void rcv_live_free_r(rcv_ctx_t *ctx, rcv_live_t *live);
+
+// rcv_daemon.c
+int rcv_daemon_serve_r(rcv_ctx_t *ctx, char *sockpath, int nthreads);
+int rcv_daemon_request_r(rcv_ctx_t *ctx, char *sockpath, char *request, int clients, int repeat);
+
+// rcv_shm.c
+rcv_shm_t *rcv_shm_open_r(rcv_ctx_t *ctx, tally_t *tally, char *name);
+void rcv_shm_close_r(rcv_ctx_t *ctx, rcv_shm_t *shm);
+const rcv_shm_table_t *rcv_shm_attach(char *name);
+int rcv_shm_snapshot(const rcv_shm_table_t *shared, rcv_shm_table_t *copy);
+void rcv_shm_detach(const rcv_shm_table_t *shared);
+int rcv_shm_unlink(char *name);
+void rcv_shm_print_r(rcv_ctx_t *ctx, const rcv_shm_table_t *table);
+
+// rcv_cache.c
+void rcv_sha256_init(rcv_sha256_t *sha);
+void rcv_sha256_update(rcv_sha256_t *sha, const void *data, size_t len);
+void rcv_sha256_final(rcv_sha256_t *sha, uint8_t digest[32]);
+int rcv_cache_election_r(rcv_ctx_t *ctx, char *fname, char *dir);
+
+// rcv_index.c
+int rcv_index_build_r(rcv_ctx_t *ctx, char *fname);
+int rcv_index_lookup_r(rcv_ctx_t *ctx, char *fname, int id, vote_t *vote);
+
+// rcv_whatif.c
+void rcv_whatif_r(rcv_ctx_t *ctx, tally_t *tally, int nthreads);
@@ -0,0 +1,223 @@
+// rcv_audit.c: Binary audit log of every vote transfer, written by a
+// background thread, and a reader rendering it as the text of the
+// "LOG: Transferred Vote" messages.
+//
+// The file is the 8 bytes RCV_AUDIT_MAGIC followed by one
+// rcv_audit_rec_t per transfer in the order the transfers happened, in
+// the byte order of the machine that wrote it.
+
+#include "rcv.h"
+#include <pthread.h>
+
+#define RCV_AUDIT_MAGIC "RCVAUD1\n"
+#define AUDIT_BUF_RECS  8192            // records per buffer
+
+typedef struct {                // One transfer in the audit log
+  int32_t round;                // round during which the vote moved
+  int32_t id;                   // ballot id
+  int16_t from;                 // candidate the vote left
+  int16_t to;                   // candidate it went to or NO_CANDIDATE if exhausted
+} rcv_audit_rec_t;
+
+struct rcv_audit {              // Audit log being written, see rcv_audit_open_r()
+  FILE *file;
+  int round;                    // round transfers currently belong to
+  rcv_audit_rec_t *fill;        // buffer being filled by the election
+  int fill_count;
+  rcv_audit_rec_t *spare;       // buffer owned by the writer thread while pending
+  int spare_count;              // records waiting to be written, 0 when spare is free
+  int done;                     // set when no more buffers will arrive
+  int error;                    // set if a write failed
+  pthread_mutex_t lock;         // guards spare_count, done and error
+  pthread_cond_t cond;          // signalled when spare_count or done changes
+  pthread_t writer;
+};
+
+static void *audit_writer(void *arg){
+    rcv_audit_t *audit = arg;
+    pthread_mutex_lock(&audit->lock);
+    while(1) {
+        while(audit->spare_count == 0 && !audit->done) {
+            pthread_cond_wait(&audit->cond, &audit->lock);
+        }
+        if(audit->spare_count == 0) {           // done and nothing pending
+            break;
+        }
+        int count = audit->spare_count;
+        pthread_mutex_unlock(&audit->lock);
+        size_t wrote = fwrite(audit->spare, sizeof(rcv_audit_rec_t), count, audit->file);
+        pthread_mutex_lock(&audit->lock);
+        if(wrote != (size_t) count) {
+            audit->error = 1;
+        }
+        audit->spare_count = 0;
+        pthread_cond_broadcast(&audit->cond);
+    }
+    pthread_mutex_unlock(&audit->lock);
+    return NULL;
+}
+// Background thread writing each buffer handed over in `spare` then
+// marking it free again, until told it is done.
+
+static void audit_handoff(rcv_audit_t *audit){
+    pthread_mutex_lock(&audit->lock);
+    while(audit->spare_count != 0) {            // writer still busy with the last one
+        pthread_cond_wait(&audit->cond, &audit->lock);
+    }
+    rcv_audit_rec_t *full = audit->fill;
+    audit->fill = audit->spare;
+    audit->spare = full;
+    audit->spare_count = audit->fill_count;
+    audit->fill_count = 0;
+    pthread_cond_broadcast(&audit->cond);
+    pthread_mutex_unlock(&audit->lock);
+}
+// Swap the filled buffer with the spare once the writer has finished
+// with it, giving the writer the filled one. The election only waits
+// here if it produces a buffer faster than one can be written.
+
+static void audit_transfer(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote, int from, int to, void *arg){
+    rcv_audit_t *audit = arg;
+    rcv_audit_rec_t *rec = &audit->fill[audit->fill_count++];
+    rec->round = audit->round;
+    rec->id = vote->id;
+    rec->from = from;
+    rec->to = to;
+    if(audit->fill_count == AUDIT_BUF_RECS) {
+        audit_handoff(audit);
+    }
+}
+// Transfer hook appending one record to the current buffer.
+
+static void audit_round(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    rcv_audit_t *audit = arg;
+    audit->round = round + 1;
+}
+// Round hook: transfers after the end of `round` belong to the next.
+
+rcv_audit_t *rcv_audit_open_r(rcv_ctx_t *ctx, char *fname, int first_round){
+    FILE *file = fopen(fname, "wb");
+    if(file == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return NULL;
+    }
+    rcv_audit_t *audit = calloc(1, sizeof(rcv_audit_t));
+    audit->file = file;
+    audit->round = first_round;
+    audit->fill = malloc(sizeof(rcv_audit_rec_t) * AUDIT_BUF_RECS);
+    audit->spare = malloc(sizeof(rcv_audit_rec_t) * AUDIT_BUF_RECS);
+    fwrite(RCV_AUDIT_MAGIC, 1, 8, file);
+    if(!rcv_ctx_add_transfer_hook(ctx, audit_transfer, audit) ||
+       !rcv_ctx_add_round_hook(ctx, audit_round, audit)) {
+        fclose(file);
+        free(audit->fill);
+        free(audit->spare);
+        free(audit);
+        return NULL;
+    }
+    pthread_mutex_init(&audit->lock, NULL);
+    pthread_cond_init(&audit->cond, NULL);
+    pthread_create(&audit->writer, NULL, audit_writer, audit);
+    return audit;
+}
+// Create the audit log `fname` and register hooks on `ctx` that record
+// every vote transfer of the elections it runs. `first_round` is the
+// round the first transfers belong to: 1 for a new election or one
+// more than the round an election is resumed from. Records are
+// collected in memory and written by a background thread so the
+// election does not wait on the disk. Prints an error and returns NULL
+// if the file can't be created or the context has no room for more
+// hooks.
+
+int rcv_audit_close_r(rcv_ctx_t *ctx, rcv_audit_t *audit){
+    if(audit->fill_count > 0) {
+        audit_handoff(audit);
+    }
+    pthread_mutex_lock(&audit->lock);
+    audit->done = 1;
+    pthread_cond_broadcast(&audit->cond);
+    pthread_mutex_unlock(&audit->lock);
+    pthread_join(audit->writer, NULL);
+
+    int ok = !audit->error;
+    if(fclose(audit->file) != 0) {
+        ok = 0;
+    }
+    pthread_mutex_destroy(&audit->lock);
+    pthread_cond_destroy(&audit->cond);
+    free(audit->fill);
+    free(audit->spare);
+    free(audit);
+    return ok;
+}
+// Write any remaining records, stop the writer thread and close the
+// log. Returns 1 on success or 0 if any write failed. The hooks stay
+// registered in the context so it must not run another election.
+
+int rcv_audit_print_r(rcv_ctx_t *ctx, char *fname, tally_t *tally, int id, int cand){
+    FILE *file = fopen(fname, "rb");
+    if(file == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return -1;
+    }
+    char magic[8];
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, RCV_AUDIT_MAGIC, 8) != 0) {
+        fprintf(ctx->out, "ERROR: '%s' is not an audit log\n", fname);
+        fclose(file);
+        return -1;
+    }
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+
+    int shown = 0, round = 0;
+    rcv_audit_rec_t recs[256];
+    size_t got;
+    while((got = fread(recs, sizeof(rcv_audit_rec_t), 256, file)) > 0) {
+        for(size_t r = 0; r < got; r++) {
+            rcv_audit_rec_t *rec = &recs[r];
+            if((id >= 0 && rec->id != id) ||
+               (cand != NO_CANDIDATE && rec->from != cand && rec->to != cand)) {
+                continue;
+            }
+            int b = rcv_ballots_find(&ballots, rec->id);
+            if(b < 0 || rec->from < 0 || rec->from >= tally->candidate_count ||
+               rec->to < NO_CANDIDATE || rec->to >= tally->candidate_count) {
+                fprintf(ctx->out, "ERROR: record for ballot %d does not match the vote file\n", rec->id);
+                continue;
+            }
+            vote_t vote = *ballots.ballots[b];
+            vote.pos = 0;                           // where vote_next_candidate() left it
+            while(vote.pos < MAX_CANDIDATES - 1 && vote.candidate_order[vote.pos] != rec->to) {
+                vote.pos++;
+            }
+            if(rec->round != round) {
+                round = rec->round;
+                fprintf(ctx->out, "=== ROUND %d ===\n", round);
+            }
+            fprintf(ctx->out, "LOG: Transferred Vote ");
+            vote_print_r(ctx, &vote);
+            if(rec->to == NO_CANDIDATE) {
+                fprintf(ctx->out, " from %d %s to Invalid Votes\n", rec->from,
+                        tally->candidate_names[rec->from]);
+            }
+            else {
+                fprintf(ctx->out, " from %d %s to %d %s\n", rec->from, tally->candidate_names[rec->from],
+                        rec->to, tally->candidate_names[rec->to]);
+            }
+            shown++;
+        }
+    }
+    fclose(file);
+    rcv_ballots_free(&ballots);
+    return shown;
+}
+// Print the transfers in audit log `fname` in the order they happened
+// exactly as tally_transfer_first_vote_r() logs them at
+// LOG_VOTE_TRANSFERS, under "=== ROUND N ===" headlines for the rounds
+// they happened in. `tally` must be
+// loaded from the vote file the election was run on; it supplies the
+// candidate names and the ballot rankings, which the log does not
+// store. Only transfers of ballot `id` are shown if it is not negative
+// and only those from or to candidate `cand` if it is not
+// NO_CANDIDATE. Returns the number of transfers printed or -1 if the
+// log can't be read.
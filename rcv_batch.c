@@ -0,0 +1,205 @@
+// rcv_batch.c: Multi-contest batch mode which loads and tabulates
+// many vote files concurrently on the thread pool in rcv_pool.c.
+
+#include "rcv.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+double rcv_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+// Returns a monotonic time in seconds for measuring elapsed time.
+
+static int contest_cmp(const void *a, const void *b){
+    const rcv_contest_t *ca = a, *cb = b;
+    return strcmp(ca->fname, cb->fname);
+}
+
+static void batch_add(rcv_contest_t **contests, int *count, int *cap, char *fname){
+    if(*count == *cap) {
+        *cap = *cap == 0 ? 16 : *cap * 2;
+        *contests = realloc(*contests, sizeof(rcv_contest_t) * (*cap));
+    }
+    rcv_contest_t *c = &(*contests)[(*count)++];
+    memset(c, 0, sizeof(rcv_contest_t));
+    snprintf(c->fname, sizeof(c->fname), "%s", fname);
+    c->condition = TALLY_ERROR;
+    c->winner = NO_CANDIDATE;
+}
+
+int rcv_batch_collect_r(rcv_ctx_t *ctx, char *path, rcv_contest_t **contests){
+    int count = 0, cap = 0;
+    *contests = NULL;
+    struct stat sb;
+    if(stat(path, &sb) != 0) {
+        fprintf(ctx->out, "ERROR: couldn't open batch '%s'\n", path);
+        return -1;
+    }
+
+    if(S_ISDIR(sb.st_mode)) {                   // every regular file in the directory
+        DIR *dir = opendir(path);
+        if(dir == NULL) {
+            fprintf(ctx->out, "ERROR: couldn't open batch '%s'\n", path);
+            return -1;
+        }
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            char full[PATH_MAX];
+            snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
+            struct stat fsb;
+            if(ent->d_name[0] != '.' && stat(full, &fsb) == 0 && S_ISREG(fsb.st_mode)) {
+                batch_add(contests, &count, &cap, full);
+            }
+        }
+        closedir(dir);
+        qsort(*contests, count, sizeof(rcv_contest_t), contest_cmp);
+    }
+    else {                                      // manifest: one vote file per line
+        FILE *manifest = fopen(path, "r");
+        if(manifest == NULL) {
+            fprintf(ctx->out, "ERROR: couldn't open batch '%s'\n", path);
+            return -1;
+        }
+        char line[PATH_MAX];
+        while(fgets(line, sizeof(line), manifest) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if(line[0] != '\0' && line[0] != '#') {
+                batch_add(contests, &count, &cap, line);
+            }
+        }
+        fclose(manifest);
+    }
+    return count;
+}
+// Fill `contests` with a heap-allocated array of contests to run and
+// return its length. If `path` is a directory, every regular file in it
+// not starting with '.' is a contest, ordered by name. Otherwise `path`
+// is a manifest listing one vote file per line; blank lines and lines
+// starting with # are ignored and contests keep the manifest
+// order. Prints an error to ctx->out and returns -1 if `path` can't
+// be read.
+
+typedef struct {                // Arguments shared by all batch tasks
+  rcv_contest_t *contests;
+  int log_level;
+  char *outdir;                 // directory for per-contest output files or NULL for buffers
+} batch_job_t;
+
+static void batch_task(void *arg, int i, int worker){
+    batch_job_t *job = arg;
+    rcv_contest_t *c = &job->contests[i];
+
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    ctx.log_level = job->log_level;
+    FILE *out = NULL;
+    if(job->outdir != NULL) {
+        out = c->outname[0] != '\0' ? fopen(c->outname, "w") : NULL;
+    }
+    else {
+        out = open_memstream(&c->output, &c->output_len);
+    }
+    if(out == NULL) {
+        snprintf(c->message, sizeof(c->message), "ERROR: couldn't write output");
+        return;
+    }
+    ctx.out = out;
+
+    double start = rcv_now();
+    tally_t *tally = tally_from_file_r(&ctx, c->fname);
+    double loaded = rcv_now();
+    c->load_secs = loaded - start;
+    if(tally == NULL) {
+        snprintf(c->message, sizeof(c->message), "ERROR: couldn't load votes");
+        fclose(out);
+        return;
+    }
+    c->candidate_count = tally->candidate_count;
+    c->votes = ctx.stats.votes_added;
+    c->condition = tally_election_r(&ctx, tally);
+    c->tally_secs = rcv_now() - loaded;
+    c->rounds = ctx.stats.rounds;
+    c->winner = ctx.stats.winner;
+    if(c->condition == TALLY_WINNER) {
+        snprintf(c->message, sizeof(c->message), "Winner: %s (candidate %d)",
+                 tally->candidate_names[c->winner], c->winner);
+    }
+    else if(c->condition == TALLY_TIE) {
+        snprintf(c->message, sizeof(c->message), "Multiway Tie");
+    }
+    else {
+        snprintf(c->message, sizeof(c->message), "Error in tabulation");
+    }
+    tally_free_r(&ctx, tally);
+    fclose(out);
+}
+// Load and tabulate a single contest with its own context so that
+// output and stats never mix between threads.
+
+static void batch_name_outputs(rcv_contest_t *contests, int count, char *outdir){
+    for(int i = 0; i < count; i++) {
+        rcv_contest_t *c = &contests[i];
+        char *base = strrchr(c->fname, '/');
+        base = base == NULL ? c->fname : base + 1;
+        int len = snprintf(c->outname, sizeof(c->outname), "%s/%s.out", outdir, base);
+        for(int k = 2, j = 0; len < (int) sizeof(c->outname) && j < i; j++) {
+            if(strcmp(contests[j].outname, c->outname) == 0) {    // taken, try the next suffix
+                len = snprintf(c->outname, sizeof(c->outname), "%s/%s-%d.out", outdir, base, k++);
+                j = -1;
+            }
+        }
+        if(len >= (int) sizeof(c->outname)) {
+            c->outname[0] = '\0';             // too long, reported as unwritable
+        }
+    }
+}
+// Name the output file of each contest outdir/NAME.out after the base
+// name of its vote file. Contests from different directories can
+// share a base name, so a name already taken by an earlier contest
+// gets the first free suffix, NAME-2.out, NAME-3.out and so on.
+
+int rcv_batch_run(rcv_contest_t *contests, int count, int log_level, char *outdir, int nthreads){
+    if(outdir != NULL) {
+        batch_name_outputs(contests, count, outdir);
+    }
+    batch_job_t job = {.contests = contests, .log_level = log_level, .outdir = outdir};
+    return rcv_pool_run(nthreads, count, batch_task, &job);
+}
+// Tabulate every contest concurrently on up to `nthreads` threads
+// (all processors if < 1) filling in the result fields of each
+// contest. With an `outdir`, each contest's output is written to the
+// file named by batch_name_outputs(), kept in its `outname`;
+// otherwise it is kept in the contest's `output` buffer. Returns the
+// number of threads used.
+
+void rcv_batch_print_summary(FILE *out, rcv_contest_t *contests, int count, int nthreads, double total_secs){
+    double sum_secs = 0.0;
+    fprintf(out, "=== BATCH SUMMARY ===\n");
+    fprintf(out, "%-32s %5s %8s %6s %9s %9s %s\n",
+            "CONTEST", "CANDS", "VOTES", "ROUNDS", "LOAD_MS", "TALLY_MS", "RESULT");
+    for(int i = 0; i < count; i++) {
+        rcv_contest_t *c = &contests[i];
+        fprintf(out, "%-32s %5d %8ld %6d %9.3f %9.3f %s\n",
+                c->fname, c->candidate_count, c->votes, c->rounds,
+                c->load_secs * 1000, c->tally_secs * 1000, c->message);
+        sum_secs += c->load_secs + c->tally_secs;
+    }
+    fprintf(out, "%d contests on %d threads: %.3f s elapsed, %.3f s serial work\n",
+            count, nthreads, total_secs, sum_secs);
+}
+// Print one line per contest giving the candidate and vote counts,
+// rounds, load and tabulation times in milliseconds, and the
+// result. The final line compares elapsed time against the summed
+// per-contest times which shows how well the run scaled across
+// threads.
+
+void rcv_batch_free(rcv_contest_t *contests, int count){
+    for(int i = 0; i < count; i++) {
+        free(contests[i].output);
+    }
+    free(contests);
+}
+// De-allocate a contest array along with any buffered output.
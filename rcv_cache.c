@@ -0,0 +1,330 @@
+// rcv_cache.c: On-disk cache of complete election output keyed by a
+// SHA-256 hash of the vote file's contents together with the options
+// affecting the output and the output format version, so re-running an
+// identical contest prints the stored output without tabulating.
+//
+// A cache directory holds two kinds of files, both replaced atomically
+// by rename():
+//
+//   <64 hex digits>       an entry: rcv_cache_head_t then the output
+//   stat-<64 hex digits>  the size, times and content hash of one vote
+//                         file path last time it was hashed
+//
+// The stat records let an unchanged file be looked up with one stat()
+// instead of re-hashing its contents.
+
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define RCV_CACHE_VERSION "rcv-cache-2"   // change whenever printed output changes
+#define RCV_CACHE_MAGIC   "RCVCACH1"
+#define RCV_STAT_MAGIC    "RCVSTAT1"
+
+typedef struct {                // Header of a cache entry
+  char magic[8];
+  int32_t condition;            // of the election, as tally_election_r() returns
+  int32_t winner;
+  int32_t rounds;
+  int32_t pad;
+  int64_t len;                  // bytes of output following
+} rcv_cache_head_t;
+
+typedef struct {                // Stat record of a vote file path
+  char magic[8];
+  int64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  int64_t ctime_sec, ctime_nsec;
+  uint8_t digest[32];           // SHA-256 of the contents with these stats
+} rcv_cache_stat_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// SHA-256 (FIPS 180-4)
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const uint8_t *p){
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+               (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+// Compress one 64-byte block into the hash state.
+
+void rcv_sha256_init(rcv_sha256_t *sha){
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sha->h, init, sizeof(init));
+    sha->len = 0;
+    sha->used = 0;
+}
+
+void rcv_sha256_update(rcv_sha256_t *sha, const void *data, size_t len){
+    const uint8_t *p = data;
+    sha->len += len;
+    if(sha->used > 0) {                         // top up a partial block first
+        size_t take = 64 - sha->used < len ? 64 - sha->used : len;
+        memcpy(sha->buf + sha->used, p, take);
+        sha->used += take;
+        p += take;
+        len -= take;
+        if(sha->used < 64) {
+            return;
+        }
+        sha256_block(sha->h, sha->buf);
+        sha->used = 0;
+    }
+    for(; len >= 64; p += 64, len -= 64) {      // whole blocks straight from the input
+        sha256_block(sha->h, p);
+    }
+    memcpy(sha->buf, p, len);
+    sha->used = len;
+}
+
+void rcv_sha256_final(rcv_sha256_t *sha, uint8_t digest[32]){
+    uint64_t bits = sha->len * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padlen = sha->used < 56 ? 56 - sha->used : 120 - sha->used;
+    for(int i = 0; i < 8; i++) {
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    }
+    rcv_sha256_update(sha, pad, padlen + 8);
+    for(int i = 0; i < 8; i++) {
+        digest[4 * i] = sha->h[i] >> 24;
+        digest[4 * i + 1] = sha->h[i] >> 16;
+        digest[4 * i + 2] = sha->h[i] >> 8;
+        digest[4 * i + 3] = sha->h[i];
+    }
+}
+// Streaming SHA-256: init, update with any number of pieces of input
+// of any length, then final to get the 32 byte digest.
+
+////////////////////////////////////////////////////////////////////////////////
+// CACHE
+
+static void cache_hex(char *dest, const uint8_t digest[32]){
+    for(int i = 0; i < 32; i++) {
+        sprintf(dest + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static int cache_mkdirs(char *dir){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    if(path[0] == '\0') {
+        return 0;
+    }
+    for(char *p = path + 1; ; p++) {
+        if(*p == '/' || *p == '\0') {
+            char ch = *p;
+            *p = '\0';
+            if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+                return 0;
+            }
+            *p = ch;
+            if(ch == '\0') {
+                return 1;
+            }
+        }
+    }
+}
+// Create `dir` and any missing parents, like mkdir -p.
+
+static int cache_hash_file(char *fname, uint8_t digest[32]){
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    rcv_sha256_t sha;
+    rcv_sha256_init(&sha);
+    char *buf = malloc(1 << 20);
+    ssize_t got;
+    while((got = read(fd, buf, 1 << 20)) > 0 || (got < 0 && errno == EINTR)) {
+        if(got > 0) {
+            rcv_sha256_update(&sha, buf, got);
+        }
+    }
+    free(buf);
+    close(fd);
+    rcv_sha256_final(&sha, digest);
+    return got == 0;
+}
+// Hash the raw contents of a file, compressed or not, a block at a time.
+
+static void cache_fill_stat(rcv_cache_stat_t *rec, struct stat *st){
+    memset(rec, 0, sizeof(rcv_cache_stat_t));
+    memcpy(rec->magic, RCV_STAT_MAGIC, 8);
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->size = st->st_size;
+    rec->mtime_sec = st->st_mtim.tv_sec;
+    rec->mtime_nsec = st->st_mtim.tv_nsec;
+    rec->ctime_sec = st->st_ctim.tv_sec;
+    rec->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int cache_write(char *dir, char *name, void *head, size_t head_len, void *data, size_t len){
+    char tmp[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = mkstemp(tmp);
+    if(fd < 0) {
+        return 0;
+    }
+    FILE *file = fdopen(fd, "wb");
+    int ok = fwrite(head, 1, head_len, file) == head_len && fwrite(data, 1, len, file) == len;
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+    if(!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+// Write a file of the cache under a temporary name then rename it into
+// place so other processes never see it half written.
+
+static int cache_digest(char *dir, char *fname, struct stat *st, uint8_t digest[32]){
+    char real[PATH_MAX], name[80], path[PATH_MAX];
+    uint8_t key[32];
+    if(realpath(fname, real) == NULL) {
+        return 0;
+    }
+    rcv_sha256_t sha;
+    rcv_sha256_init(&sha);
+    rcv_sha256_update(&sha, real, strlen(real));
+    rcv_sha256_final(&sha, key);
+    strcpy(name, "stat-");
+    cache_hex(name + 5, key);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    rcv_cache_stat_t now, rec;
+    cache_fill_stat(&now, st);
+    FILE *file = fopen(path, "rb");
+    if(file != NULL) {
+        int found = fread(&rec, sizeof(rec), 1, file) == 1;
+        fclose(file);
+        if(found && memcmp(&rec, &now, offsetof(rcv_cache_stat_t, digest)) == 0) {
+            memcpy(digest, rec.digest, 32);
+            return 1;
+        }
+    }
+    if(!cache_hash_file(fname, digest)) {
+        return 0;
+    }
+    memcpy(now.digest, digest, 32);
+    cache_write(dir, name, &now, sizeof(now), NULL, 0);
+    return 1;
+}
+// Get the content hash of vote file `fname` with stats `st`: taken from
+// its stat record when the file's device, inode, size, modification and
+// change times all still match, otherwise computed by reading the file
+// and recorded for next time.
+
+int rcv_cache_election_r(rcv_ctx_t *ctx, char *fname, char *dir){
+    struct stat before;
+    uint8_t content[32], key[32];
+    char name[80], path[PATH_MAX];
+    int cacheable = strcmp(fname, "-") != 0 && stat(fname, &before) == 0 && S_ISREG(before.st_mode) &&
+                    cache_mkdirs(dir) && cache_digest(dir, fname, &before, content);
+    if(cacheable) {
+        char options[PATH_MAX + 80];            // file I/O logs print the file name
+        snprintf(options, sizeof(options), "%s log=%d validate=%d lines=%d path=%s", RCV_CACHE_VERSION,
+                 ctx->log_level, ctx->validate, ctx->line_mode, ctx->log_level >= LOG_FILEIO ? fname : "");
+        rcv_sha256_t sha;
+        rcv_sha256_init(&sha);
+        rcv_sha256_update(&sha, content, 32);
+        rcv_sha256_update(&sha, options, strlen(options) + 1);
+        rcv_sha256_final(&sha, key);
+        cache_hex(name, key);
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+        FILE *file = fopen(path, "rb");         // hit: copy the stored output
+        rcv_cache_head_t head;
+        if(file != NULL && fread(&head, sizeof(head), 1, file) == 1 &&
+           memcmp(head.magic, RCV_CACHE_MAGIC, 8) == 0 && head.len >= 0) {
+            char *output = malloc(head.len + 1);
+            if(fread(output, 1, head.len, file) == (size_t) head.len) {
+                fclose(file);
+                fwrite(output, 1, head.len, ctx->out);
+                free(output);
+                ctx->stats.winner = head.winner;
+                ctx->stats.rounds = head.rounds;
+                return head.condition;
+            }
+            free(output);
+        }
+        if(file != NULL) {
+            fclose(file);
+        }
+    }
+
+    rcv_ctx_t run = *ctx;                       // miss: tabulate, capturing the output
+    char *output = NULL;
+    size_t len = 0;
+    run.out = open_memstream(&output, &len);
+    int condition = TALLY_ERROR;
+    tally_t *tally = tally_from_file_r(&run, fname);
+    if(tally != NULL) {
+        condition = tally_election_r(&run, tally);
+        tally_free_r(&run, tally);
+    }
+    fclose(run.out);
+    fwrite(output, 1, len, ctx->out);
+    ctx->stats = run.stats;
+
+    struct stat after;
+    if(cacheable && tally != NULL && stat(fname, &after) == 0 &&
+       after.st_size == before.st_size &&
+       after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec) {
+        rcv_cache_head_t head = {.condition = condition, .winner = run.stats.winner,
+                                 .rounds = run.stats.rounds, .len = len};
+        memcpy(head.magic, RCV_CACHE_MAGIC, 8);
+        cache_write(dir, name, &head, sizeof(head), output, len);
+    }
+    free(output);
+    return tally == NULL ? -1 : condition;
+}
+// Run the election in vote file `fname` at ctx->log_level, ctx->validate
+// and ctx->line_mode through the cache in directory `dir`, created if
+// needed. At LOG_FILEIO and above the path is part of the key as well,
+// since the logs print it. On a hit the output of
+// the earlier run, logs included, is printed byte for byte without
+// loading the file; otherwise the file is loaded and tabulated as
+// usual and its output stored, unless the file changed while it was
+// read. A file that hasn't changed since it was last hashed costs one
+// stat() to look up. Standard input and other non-regular files are
+// tabulated without the cache. Sets ctx->stats.winner and rounds.
+// Returns the election's condition, or -1 if the file couldn't be
+// loaded, which is never cached.
@@ -0,0 +1,247 @@
+// rcv_checkpoint.c: Checkpoints of a running election written after
+// every round so that a long tabulation which is interrupted can be
+// resumed from its last completed round.
+//
+// A checkpoint file, in the byte order of the machine that wrote it, is
+// the 8 bytes RCV_CKPT_MAGIC then
+//
+//   int32 candidate_count, ballot_count, rounds
+//   rounds x { int32 counts[candidate_count]; int32 invalid;
+//              char status[candidate_count] }
+//   candidate_count+1 x { int32 length; length x { int32 id, pos } }
+//
+// The rows hold the counts and statuses at the end of each round, after
+// its MINVOTES marking; the last row is the state to resume from. The
+// lists are the vote lists of each candidate then the invalid votes in
+// order, each vote as its id and pos.
+
+#include "rcv.h"
+#include <unistd.h>
+
+#define RCV_CKPT_MAGIC "RCVCKP1\n"
+
+typedef struct {                // State at the end of one round
+  int32_t counts[MAX_CANDIDATES];
+  int32_t invalid;
+  char status[MAX_CANDIDATES];
+} ckpt_row_t;
+
+struct rcv_checkpoint {         // Checkpoints being written, see rcv_checkpoint_open_r()
+  char *fname;                  // checkpoint file
+  char *tmpname;                // written first then renamed over fname
+  int ballot_count;
+  int rounds;                   // rows in use
+  int cap;
+  ckpt_row_t *rows;             // rows[r-1] is the end of round r
+  int error;                    // set if a checkpoint couldn't be written
+};
+
+static int ckpt_write(rcv_checkpoint_t *ckpt, tally_t *tally){
+    FILE *file = fopen(ckpt->tmpname, "wb");
+    if(file == NULL) {
+        return 0;
+    }
+    int n = tally->candidate_count;
+    int32_t head[3] = {n, ckpt->ballot_count, ckpt->rounds};
+    fwrite(RCV_CKPT_MAGIC, 1, 8, file);
+    fwrite(head, sizeof(int32_t), 3, file);
+    for(int r = 0; r < ckpt->rounds; r++) {
+        fwrite(ckpt->rows[r].counts, sizeof(int32_t), n, file);
+        fwrite(&ckpt->rows[r].invalid, sizeof(int32_t), 1, file);
+        fwrite(ckpt->rows[r].status, 1, n, file);
+    }
+    for(int c = 0; c <= n; c++) {               // list n is the invalid votes
+        vote_t *list = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        int32_t length = 0;
+        for(vote_t *vote = list; vote != NULL; vote = vote->next) {
+            length++;
+        }
+        fwrite(&length, sizeof(int32_t), 1, file);
+        for(vote_t *vote = list; vote != NULL; vote = vote->next) {
+            int32_t rec[2] = {vote->id, vote->pos};
+            fwrite(rec, sizeof(int32_t), 2, file);
+        }
+    }
+    int ok = fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+    return ok && rename(ckpt->tmpname, ckpt->fname) == 0;
+}
+// Write the whole checkpoint to the temporary file, flush it to disk
+// and rename it over the checkpoint. The rename is atomic so the
+// checkpoint file always holds a complete earlier or later round, never
+// a partial one, whenever the process is stopped.
+
+static void ckpt_round(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    rcv_checkpoint_t *ckpt = arg;
+    if(ckpt->rounds == ckpt->cap) {
+        ckpt->cap *= 2;
+        ckpt->rows = realloc(ckpt->rows, sizeof(ckpt_row_t) * ckpt->cap);
+    }
+    ckpt_row_t *row = &ckpt->rows[ckpt->rounds++];
+    for(int c = 0; c < tally->candidate_count; c++) {
+        row->counts[c] = tally->candidate_vote_counts[c];
+        row->status[c] = tally->candidate_status[c];
+    }
+    row->invalid = tally->invalid_vote_count;
+    if(!ckpt_write(ckpt, tally)) {
+        ckpt->error = 1;
+    }
+}
+// Round hook recording the end of `round` and writing a checkpoint.
+
+static int ckpt_read(rcv_ctx_t *ctx, rcv_checkpoint_t *ckpt, tally_t *tally, FILE *file){
+    int n = tally->candidate_count;
+    char magic[8];
+    int32_t head[3];
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, RCV_CKPT_MAGIC, 8) != 0 ||
+       fread(head, sizeof(int32_t), 3, file) != 3 ||
+       head[0] != n || head[1] != ckpt->ballot_count || head[2] < 1 || head[2] > n + 1) {
+        return 0;
+    }
+    ckpt->rounds = head[2];
+    while(ckpt->cap < ckpt->rounds) {
+        ckpt->cap *= 2;
+    }
+    ckpt->rows = realloc(ckpt->rows, sizeof(ckpt_row_t) * ckpt->cap);
+    for(int r = 0; r < ckpt->rounds; r++) {
+        ckpt_row_t *row = &ckpt->rows[r];
+        if(fread(row->counts, sizeof(int32_t), n, file) != n ||
+           fread(&row->invalid, sizeof(int32_t), 1, file) != 1 ||
+           fread(row->status, 1, n, file) != n) {
+            return 0;
+        }
+    }
+
+    rcv_ballots_t ballots;                      // vote of each id
+    rcv_ballots_init(&ballots, tally);
+    int32_t lengths[MAX_CANDIDATES + 1];        // read and check everything before relinking
+    int32_t *recs = malloc(sizeof(int32_t) * 2 * (ckpt->ballot_count + 1));
+    char *seen = calloc(ckpt->ballot_count + 1, 1);
+    int ok = 1, total = 0;
+    for(int c = 0; c <= n && ok; c++) {
+        ok = fread(&lengths[c], sizeof(int32_t), 1, file) == 1 &&
+             lengths[c] >= 0 && lengths[c] <= ckpt->ballot_count - total &&
+             fread(recs + 2 * total, sizeof(int32_t), 2 * lengths[c], file) == 2 * lengths[c];
+        for(int k = total; ok && k < total + lengths[c]; k++) {
+            int b = rcv_ballots_find(&ballots, recs[2 * k]), pos = recs[2 * k + 1];
+            ok = b >= 0 && !seen[b] && pos >= 0 && pos < MAX_CANDIDATES;
+            if(ok) {
+                seen[b] = 1;
+                recs[2 * k] = b;                // relinked by index below
+            }
+        }
+        total += ok ? lengths[c] : 0;
+    }
+    free(seen);
+    if(!ok || total != ckpt->ballot_count) {
+        free(recs);
+        rcv_ballots_free(&ballots);
+        return 0;
+    }
+
+    int k = 0;
+    for(int c = 0; c <= n; c++) {
+        vote_t **tail = c < n ? &tally->candidate_votes[c] : &tally->invalid_votes;
+        for(int end = k + lengths[c]; k < end; k++) {
+            vote_t *vote = ballots.ballots[recs[2 * k]];
+            vote->pos = recs[2 * k + 1];
+            *tail = vote;
+            tail = &vote->next;
+        }
+        *tail = NULL;
+    }
+    free(recs);
+    rcv_ballots_free(&ballots);
+    ckpt_row_t *last = &ckpt->rows[ckpt->rounds - 1];
+    for(int c = 0; c < n; c++) {
+        tally->candidate_vote_counts[c] = last->counts[c];
+        tally->candidate_status[c] = last->status[c];
+    }
+    tally->invalid_vote_count = last->invalid;
+    return 1;
+}
+// Load a checkpoint into `ckpt` then relink the votes of `tally` into
+// the recorded lists with their recorded pos. The whole file is checked
+// first, so `tally` is left untouched and 0 returned if it is not a
+// checkpoint of an election on these ballots.
+
+static void ckpt_print_rounds(rcv_ctx_t *ctx, rcv_checkpoint_t *ckpt, tally_t *tally){
+    tally_t *shown = malloc(sizeof(tally_t));
+    *shown = *tally;
+    for(int r = 0; r < ckpt->rounds; r++) {
+        ckpt_row_t *row = &ckpt->rows[r];
+        for(int c = 0; c < tally->candidate_count; c++) {
+            shown->candidate_vote_counts[c] = row->counts[c];
+            shown->candidate_status[c] = row->status[c] == CAND_MINVOTES ? CAND_ACTIVE : row->status[c];
+        }
+        shown->invalid_vote_count = row->invalid;
+        fprintf(ctx->out, "=== ROUND %d ===\n", r + 1);
+        tally_print_table_r(ctx, shown);
+    }
+    free(shown);
+}
+// Print the headline and table of every checkpointed round as the
+// election printed them. Tables are printed before the MINVOTES marking
+// so candidates marked at the end of a round show as active.
+
+rcv_checkpoint_t *rcv_checkpoint_open_r(rcv_ctx_t *ctx, tally_t *tally, char *fname, int *resume_round){
+    rcv_checkpoint_t *ckpt = calloc(1, sizeof(rcv_checkpoint_t));
+    ckpt->fname = strdup(fname);
+    ckpt->tmpname = malloc(strlen(fname) + 5);
+    sprintf(ckpt->tmpname, "%s.tmp", fname);
+    ckpt->cap = 16;
+    ckpt->rows = malloc(sizeof(ckpt_row_t) * ckpt->cap);
+    for(int c = 0; c <= tally->candidate_count; c++) {
+        vote_t *vote = c < tally->candidate_count ? tally->candidate_votes[c] : tally->invalid_votes;
+        for(; vote != NULL; vote = vote->next) {
+            ckpt->ballot_count++;
+        }
+    }
+
+    FILE *file = resume_round == NULL ? NULL : fopen(fname, "rb");
+    if(file != NULL) {
+        int ok = ckpt_read(ctx, ckpt, tally, file);
+        fclose(file);
+        if(!ok) {
+            fprintf(ctx->out, "ERROR: '%s' is not a checkpoint of this election\n", fname);
+            rcv_checkpoint_close_r(ctx, ckpt);
+            return NULL;
+        }
+        ckpt_print_rounds(ctx, ckpt, tally);
+    }
+    if(resume_round != NULL) {
+        *resume_round = ckpt->rounds;
+    }
+    if(!rcv_ctx_add_round_hook(ctx, ckpt_round, ckpt)) {
+        rcv_checkpoint_close_r(ctx, ckpt);
+        return NULL;
+    }
+    return ckpt;
+}
+// Register a round hook on `ctx` which checkpoints the election about
+// to be run on the freshly loaded `tally` to `fname` after every round.
+// If `resume_round` is not NULL and `fname` exists the tally is first
+// put back in the state of its last checkpointed round, the tables of
+// all checkpointed rounds are printed as the election printed them,
+// and `*resume_round` is set to that round, or to 0 when there is no
+// checkpoint yet; the caller then continues the election with
+// tally_election_resume_r(). At the default log level the output is
+// then identical to an uninterrupted run; log messages of the
+// checkpointed rounds are not repeated. Prints an error and returns
+// NULL if the file is not a checkpoint of this election or the context
+// has no room for more hooks.
+
+int rcv_checkpoint_close_r(rcv_ctx_t *ctx, rcv_checkpoint_t *ckpt){
+    int ok = !ckpt->error;
+    free(ckpt->fname);
+    free(ckpt->tmpname);
+    free(ckpt->rows);
+    free(ckpt);
+    return ok;
+}
+// De-allocate a checkpoint, leaving the file of the last round in
+// place. Returns 1 if every checkpoint was written or 0 if any write
+// failed. The hook stays registered in the context so it must not run
+// another election.
@@ -0,0 +1,265 @@
+// rcv_cvr.c: Import of cast vote record (CVR) CSV exports, which give
+// rankings by candidate name rather than index:
+//
+//   BallotID,Precinct,Rank 1,Rank 2,Rank 3
+//   1001,P-12,Heather,Francis,
+//   1002,P-12,"Viktor",Claire,Heather
+//
+// Columns whose header contains "rank" or "choice", in any case, hold
+// the rankings in order; if none do, every column after the first
+// does. Other columns are ignored. Empty cells and "undervote" or
+// "skipped" are passed over, and "overvote" ends the ranking there.
+// Fields may be quoted with embedded commas and doubled quotes but may
+// not contain newlines. Candidates are numbered in the order their
+// names first appear.
+
+#include "rcv.h"
+#include <strings.h>
+
+#define CVR_MAX_COLS 1024               // columns per CSV row
+
+typedef struct {                // One interned candidate name
+  uint64_t hash;
+  char *name;                   // NULL for an empty slot
+  int index;                    // candidate index in the tally
+} cvr_slot_t;
+
+typedef struct {                // Open addressing hash table of candidate names
+  cvr_slot_t *slots;
+  int cap;                      // power of 2
+  int count;
+} cvr_names_t;
+
+static uint64_t cvr_hash(const char *s){
+    uint64_t h = 0xcbf29ce484222325ULL;         // FNV-1a
+    for(; *s != '\0'; s++) {
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void cvr_names_grow(cvr_names_t *names){
+    cvr_slot_t *old = names->slots;
+    int old_cap = names->cap;
+    names->cap = old_cap == 0 ? 64 : old_cap * 2;
+    names->slots = calloc(names->cap, sizeof(cvr_slot_t));
+    for(int i = 0; i < old_cap; i++) {
+        if(old[i].name != NULL) {
+            int s = old[i].hash & (names->cap - 1);
+            while(names->slots[s].name != NULL) {
+                s = (s + 1) & (names->cap - 1);
+            }
+            names->slots[s] = old[i];
+        }
+    }
+    free(old);
+}
+// Double the table, re-inserting every name at its new slot.
+
+static int cvr_intern(rcv_ctx_t *ctx, cvr_names_t *names, tally_t *tally, char *name, char *fname){
+    uint64_t hash = cvr_hash(name);
+    int s = hash & (names->cap - 1);
+    for(; names->slots[s].name != NULL; s = (s + 1) & (names->cap - 1)) {
+        if(names->slots[s].hash == hash && strcmp(names->slots[s].name, name) == 0) {
+            return names->slots[s].index;
+        }
+    }
+    if(tally->candidate_count == MAX_CANDIDATES) {
+        return -2;
+    }
+    int index = tally->candidate_count++;
+    names->slots[s] = (cvr_slot_t) {.hash = hash, .name = strdup(name), .index = index};
+    names->count++;
+    snprintf(tally->candidate_names[index], MAX_NAME, "%s", name);
+    tally->candidate_status[index] = CAND_ACTIVE;
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' candidate %d is %s\n", fname, index, tally->candidate_names[index]);
+    }
+    if(names->count * 2 > names->cap) {         // keep the load at most 1/2
+        cvr_names_grow(names);
+    }
+    return index;
+}
+// Return the candidate index of `name`, adding it as a new active
+// candidate of the tally the first time it is seen. Only names with
+// the same hash are compared. Returns -2 if the tally already has
+// MAX_CANDIDATES candidates.
+
+static int cvr_split(char *line, char **fields){
+    int count = 0;
+    char *p = line;
+    while(count < CVR_MAX_COLS) {
+        char *out = p;
+        fields[count++] = p;
+        if(*p == '"') {                         // quoted: copy down, "" is one quote
+            char *q = p + 1;
+            while(*q != '\0') {
+                if(*q == '"' && q[1] == '"') {
+                    *out++ = '"';
+                    q += 2;
+                }
+                else if(*q == '"') {
+                    q++;
+                    break;
+                }
+                else {
+                    *out++ = *q++;
+                }
+            }
+            while(*q != '\0' && *q != ',') {    // anything after the closing quote
+                *out++ = *q++;
+            }
+            p = q;
+        }
+        else {
+            while(*p != '\0' && *p != ',') {
+                p++;
+            }
+            out = p;
+        }
+        int more = *p == ',';
+        *out = '\0';
+        if(!more) {
+            break;
+        }
+        p++;
+    }
+    return count;
+}
+// Split a CSV line, without its newline, into fields in place. Returns
+// the number of fields.
+
+static int cvr_rank_col(char *header){
+    char lower[MAX_NAME];
+    int i = 0;
+    for(; header[i] != '\0' && i < MAX_NAME - 1; i++) {
+        lower[i] = header[i] >= 'A' && header[i] <= 'Z' ? header[i] - 'A' + 'a' : header[i];
+    }
+    lower[i] = '\0';
+    return strstr(lower, "rank") != NULL || strstr(lower, "choice") != NULL;
+}
+
+static int cvr_is(char *cell, char *word){
+    return strcasecmp(cell, word) == 0;
+}
+
+tally_t *tally_from_cvr_r(rcv_ctx_t *ctx, char *fname){
+    FILE *file = rcv_input_open(fname);
+    if(file == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return NULL;
+    }
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' opened\n", fname);
+    }
+    tally_t *tally = ctx->alloc(sizeof(tally_t));
+    memset(tally, 0, sizeof(tally_t));
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    char **fields = malloc(sizeof(char *) * CVR_MAX_COLS);
+    int rank_cols[CVR_MAX_COLS];
+    int rank_count = 0;
+    ssize_t len = getline(&line, &line_cap, file);
+    if(len > 0) {                               // header picks the rank columns
+        line[strcspn(line, "\r\n")] = '\0';
+        int cols = cvr_split(line, fields);
+        for(int c = 0; c < cols; c++) {
+            if(cvr_rank_col(fields[c])) {
+                rank_cols[rank_count++] = c;
+            }
+        }
+        if(rank_count == 0) {                   // no rank headers: all but the first column
+            for(int c = 1; c < cols; c++) {
+                rank_cols[rank_count++] = c;
+            }
+        }
+    }
+
+    cvr_names_t names = {0};
+    cvr_names_grow(&names);
+    int ok = 1;
+    long lineno = 1;                            // the header is line 1
+    for(int id = 1; ok && (len = getline(&line, &line_cap, file)) > 0; ) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0') {
+            continue;
+        }
+        int cols = cvr_split(line, fields);
+        vote_t *vote = vote_make_empty_r(ctx);
+        vote->id = id++;
+        vote->pos = 0;
+        int ranked = 0;
+        uint64_t seen[MAX_CANDIDATES / 64] = {0};
+        int reason = BALLOT_OK;
+        for(int r = 0; r < rank_count && rank_cols[r] < cols && ranked < MAX_CANDIDATES - 1; r++) {
+            char *cell = fields[rank_cols[r]];
+            if(cell[0] == '\0' || cvr_is(cell, "undervote") || cvr_is(cell, "skipped")) {
+                continue;
+            }
+            if(cvr_is(cell, "overvote")) {
+                break;
+            }
+            int cand = cvr_intern(ctx, &names, tally, cell, fname);
+            if(cand < 0) {
+                fprintf(ctx->out, "ERROR: '%s' has more than %d candidates\n", fname, MAX_CANDIDATES);
+                ok = 0;
+                break;
+            }
+            vote->candidate_order[ranked++] = cand;
+            int check = vote_check_ranking(cand, tally->candidate_count, seen);
+            if(reason == BALLOT_OK) {
+                reason = check;
+            }
+        }
+        int keep = ok ? tally_screen_vote_r(ctx, tally, vote, reason, fname, lineno) : 0;
+        if(keep <= 0) {                         // skipped, or rejected with the file
+            ok = ok && keep == 0;
+            ctx->dealloc(vote);
+            continue;
+        }
+        tally_add_vote_r(ctx, tally, vote);
+        if(ctx->log_level >= LOG_FILEIO) {
+            fprintf(ctx->out, "LOG: File '%s' vote ", fname);
+            vote_print_r(ctx, vote);
+            fprintf(ctx->out, "\n");
+        }
+    }
+    if(ok && ferror(file)) {
+        fprintf(ctx->out, "ERROR: couldn't read file '%s'\n", fname);
+        ok = 0;
+    }
+    if(ok && tally->candidate_count < 1) {     // no row ranks anyone
+        fprintf(ctx->out, "ERROR: '%s' has an invalid candidate count %d\n", fname, tally->candidate_count);
+        ok = 0;
+    }
+    if(ok && ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' has %d candidtes\n", fname, tally->candidate_count);
+        fprintf(ctx->out, "LOG: File '%s' end of file reached\n", fname);
+    }
+    for(int i = 0; i < names.cap; i++) {
+        free(names.slots[i].name);
+    }
+    free(names.slots);
+    free(fields);
+    free(line);
+    fclose(file);
+    if(!ok) {
+        tally_free_r(ctx, tally);
+        return NULL;
+    }
+    return tally;
+}
+// Load a CVR CSV file, or standard input for "-", into a new tally
+// like tally_from_file_r(), including gzip-compressed input. Each row
+// is parsed and added to the tally with tally_add_vote_r() as it is
+// read, resolving each name through a hash table of the names seen so
+// far, so the whole file is never held in memory and candidates need
+// no header. A row ranking a candidate twice is handled by the
+// ctx->validate policy like a bad ballot of a vote file, its id kept
+// and its line being the row's line in the CSV. Logs as
+// tally_from_file_r() does, except that candidates are logged as they
+// first appear and their count at the end. Prints an error and returns
+// NULL if the file can't be read, names no candidates or more than
+// MAX_CANDIDATES, or is rejected by the validation policy.
@@ -0,0 +1,510 @@
+// rcv_daemon.c: Tabulation daemon answering requests over a Unix domain
+// socket, keeping each contest's parsed ballots in memory between
+// requests and caching every answer until its vote file changes.
+//
+// A request is one line, "OP FILE [ARGS]" or "OP" for the requests
+// without a file:
+//
+//   tally FILE           rounds and winner, as rcv_main FILE prints them
+//   whatif FILE          winner with each candidate excluded, as -whatif
+//   margins FILE         elimination margins of each round, as -margins
+//   exclude FILE C,C...  winner with the given candidates excluded
+//   stats                contests loaded, requests served, cache hits
+//   shutdown             stop the daemon
+//
+// The answer is "OK LEN\n" followed by LEN bytes of output, or
+// "ERR MESSAGE\n". A connection may send any number of requests.
+
+#include "rcv.h"
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define DAEMON_MAX_REQUEST 4096         // longest request line
+
+typedef struct daemon_result {  // Cached answer to one request on a contest
+  char *request;                // op and arguments, without the file name
+  char *output;
+  size_t len;
+  struct daemon_result *next;
+} daemon_result_t;
+
+typedef struct daemon_contest { // One vote file kept loaded
+  char fname[PATH_MAX];
+  struct timespec mtime;        // stat() of the file when loaded
+  off_t size;
+  tally_t *tally;               // NULL until loaded
+  tally_snapshot_t *snap;       // tally as loaded, restored before each computation
+  daemon_result_t *results;
+  pthread_mutex_t lock;         // guards all the above
+  struct daemon_contest *next;
+} daemon_contest_t;
+
+typedef struct {                // Daemon state shared by connection threads
+  rcv_ctx_t *ctx;
+  int listen_fd;
+  int nthreads;                 // threads for whatif and margins
+  pthread_mutex_t lock;         // guards everything below
+  pthread_cond_t cond;          // signalled when a connection ends
+  daemon_contest_t *contests;
+  int *conns;                   // sockets of open connections
+  int conn_count, conn_cap;
+  long requests, hits, loads;
+  int stop;
+} daemon_t;
+
+typedef struct {                // Arguments of a connection thread
+  daemon_t *d;
+  int fd;
+} daemon_conn_t;
+
+static int daemon_send(int fd, char *data, size_t len){
+    while(len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if(sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 1;
+}
+// Write all of `data` to a socket without raising SIGPIPE if the
+// client has gone away. Returns 0 if the write failed.
+
+static daemon_contest_t *daemon_contest(daemon_t *d, char *fname){
+    pthread_mutex_lock(&d->lock);
+    daemon_contest_t *c = d->contests;
+    while(c != NULL && strcmp(c->fname, fname) != 0) {
+        c = c->next;
+    }
+    if(c == NULL) {
+        c = calloc(1, sizeof(daemon_contest_t));
+        snprintf(c->fname, sizeof(c->fname), "%s", fname);
+        pthread_mutex_init(&c->lock, NULL);
+        c->next = d->contests;
+        d->contests = c;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return c;
+}
+// Find or add the entry of vote file `fname`; it is loaded later by
+// daemon_load() with the entry's lock held.
+
+static void daemon_unload(daemon_t *d, daemon_contest_t *c){
+    while(c->results != NULL) {
+        daemon_result_t *res = c->results;
+        c->results = res->next;
+        free(res->request);
+        free(res->output);
+        free(res);
+    }
+    if(c->tally != NULL) {
+        tally_snapshot_free_r(d->ctx, c->snap);
+        tally_free_r(d->ctx, c->tally);
+        c->tally = NULL;
+        c->snap = NULL;
+    }
+}
+
+static int daemon_load(daemon_t *d, daemon_contest_t *c){
+    struct stat st;
+    if(stat(c->fname, &st) != 0) {
+        daemon_unload(d, c);
+        return 0;
+    }
+    if(c->tally != NULL && st.st_size == c->size &&
+       st.st_mtim.tv_sec == c->mtime.tv_sec && st.st_mtim.tv_nsec == c->mtime.tv_nsec) {
+        return 1;
+    }
+    daemon_unload(d, c);
+    rcv_ctx_t quiet = *d->ctx;
+    quiet.log_level = 0;
+    quiet.out = fopen("/dev/null", "w");
+    c->tally = tally_from_file_r(&quiet, c->fname);
+    fclose(quiet.out);
+    if(c->tally == NULL) {
+        return 0;
+    }
+    c->snap = tally_snapshot_r(d->ctx, c->tally);
+    c->mtime = st.st_mtim;
+    c->size = st.st_size;
+    pthread_mutex_lock(&d->lock);
+    d->loads++;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+// Make sure the contest's tally reflects its file: it is (re)loaded
+// the first time and whenever the file's size or modification time has
+// changed since, dropping every cached answer. Returns 0 if the file
+// can't be loaded.
+
+static int daemon_exclude(rcv_ctx_t *ctx, tally_t *tally, char *args){
+    int n = tally->candidate_count;
+    char status[MAX_CANDIDATES];
+    for(int c = 0; c < n; c++) {
+        status[c] = CAND_ACTIVE;
+    }
+    fprintf(ctx->out, "EXCLUDED");
+    for(char *p = args; *p != '\0'; ) {
+        char *end;
+        long c = strtol(p, &end, 10);
+        if(end == p || c < 0 || c >= n || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        status[c] = CAND_DROPPED;
+        fprintf(ctx->out, " %ld %s", c, tally->candidate_names[c]);
+        p = *end == ',' ? end + 1 : end;
+    }
+    fprintf(ctx->out, "\n");
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    rcv_sim_result_t res = {0};
+    rcv_sim_run(&ballots, status, NULL, &res, NULL);
+    rcv_ballots_free(&ballots);
+    if(res.condition == TALLY_WINNER) {
+        fprintf(ctx->out, "Winner: %s (candidate %d)", tally->candidate_names[res.winner], res.winner);
+    }
+    else {
+        fprintf(ctx->out, "%s", res.condition == TALLY_TIE ? "Multiway Tie" : "No result");
+    }
+    fprintf(ctx->out, " after %d rounds\n", res.rounds);
+    return 1;
+}
+// Print the result of the election with the comma separated candidate
+// indexes in `args` dropped before round 1. Returns 0 if `args` is not
+// a list of valid indexes.
+
+static int daemon_compute(daemon_t *d, daemon_contest_t *c, char *op, char *args, daemon_result_t *res){
+    rcv_ctx_t qctx;
+    rcv_ctx_init(&qctx);
+    qctx.alloc = d->ctx->alloc;
+    qctx.dealloc = d->ctx->dealloc;
+    qctx.out = open_memstream(&res->output, &res->len);
+    tally_restore_r(&qctx, c->snap);
+    int ok = 1;
+    if(strcmp(op, "tally") == 0 && args[0] == '\0') {
+        tally_election_r(&qctx, c->tally);
+    }
+    else if(strcmp(op, "whatif") == 0 && args[0] == '\0') {
+        rcv_whatif_r(&qctx, c->tally, d->nthreads);
+    }
+    else if(strcmp(op, "margins") == 0 && args[0] == '\0') {
+        rcv_margins_r(&qctx, c->tally, 0, d->nthreads);
+    }
+    else if(strcmp(op, "exclude") == 0) {
+        ok = daemon_exclude(&qctx, c->tally, args);
+    }
+    else {
+        ok = 0;
+    }
+    fclose(qctx.out);
+    return ok;
+}
+// Run request `op` with `args` on the contest's tally as loaded,
+// capturing its output in `res`. Returns 0 for an unknown request.
+
+static int daemon_answer(daemon_t *d, int fd, char *line){
+    char *save;
+    char *op = strtok_r(line, " \t\r\n", &save);
+    char *fname = strtok_r(NULL, " \t\r\n", &save);
+    char *args = strtok_r(NULL, "\r\n", &save);
+    char head[64 + PATH_MAX];
+    if(op == NULL) {
+        return daemon_send(fd, "ERR empty request\n", 18);
+    }
+    pthread_mutex_lock(&d->lock);
+    d->requests++;
+    if(strcmp(op, "stats") == 0) {
+        int count = 0;
+        for(daemon_contest_t *c = d->contests; c != NULL; c = c->next) {
+            count++;
+        }
+        char body[256];
+        int len = snprintf(body, sizeof(body), "contests %d requests %ld hits %ld loads %ld\n",
+                           count, d->requests, d->hits, d->loads);
+        pthread_mutex_unlock(&d->lock);
+        int n = snprintf(head, sizeof(head), "OK %d\n", len);
+        return daemon_send(fd, head, n) && daemon_send(fd, body, len);
+    }
+    if(strcmp(op, "shutdown") == 0) {
+        d->stop = 1;
+        shutdown(d->listen_fd, SHUT_RDWR);      // wakes the accept() loop
+        pthread_mutex_unlock(&d->lock);
+        daemon_send(fd, "OK 0\n", 5);
+        return 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if(fname == NULL) {
+        return daemon_send(fd, "ERR missing file\n", 17);
+    }
+    while(args != NULL && (*args == ' ' || *args == '\t')) {
+        args++;
+    }
+    char key[DAEMON_MAX_REQUEST];
+    snprintf(key, sizeof(key), "%s %s", op, args == NULL ? "" : args);
+
+    daemon_contest_t *c = daemon_contest(d, fname);
+    pthread_mutex_lock(&c->lock);
+    if(!daemon_load(d, c)) {
+        pthread_mutex_unlock(&c->lock);
+        int n = snprintf(head, sizeof(head), "ERR couldn't load file '%s'\n", fname);
+        return daemon_send(fd, head, n);
+    }
+    daemon_result_t *res = c->results;
+    while(res != NULL && strcmp(res->request, key) != 0) {
+        res = res->next;
+    }
+    if(res != NULL) {
+        pthread_mutex_lock(&d->lock);
+        d->hits++;
+        pthread_mutex_unlock(&d->lock);
+    }
+    else {
+        res = calloc(1, sizeof(daemon_result_t));
+        if(!daemon_compute(d, c, op, args == NULL ? "" : args, res)) {
+            pthread_mutex_unlock(&c->lock);
+            free(res->output);
+            free(res);
+            int n = snprintf(head, sizeof(head), "ERR bad request '%s'\n", op);
+            return daemon_send(fd, head, n);
+        }
+        res->request = strdup(key);
+        res->next = c->results;
+        c->results = res;
+    }
+    size_t len = res->len;                      // copy so the lock isn't held while sending
+    char *output = malloc(len + 1);
+    memcpy(output, res->output, len);
+    pthread_mutex_unlock(&c->lock);
+    int n = snprintf(head, sizeof(head), "OK %zu\n", len);
+    int ok = daemon_send(fd, head, n) && daemon_send(fd, output, len);
+    free(output);
+    return ok;
+}
+// Answer one request line. Contest entries are locked while they are
+// loaded or computed, so requests on different contests run in
+// parallel and a second request for an answer being computed waits for
+// it rather than computing it again. Returns 0 if the connection should
+// be closed.
+
+static void *daemon_conn(void *arg){
+    daemon_conn_t *conn = arg;
+    daemon_t *d = conn->d;
+    FILE *in = fdopen(conn->fd, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&line, &cap, in)) > 0) {
+        if(len > DAEMON_MAX_REQUEST) {
+            daemon_send(conn->fd, "ERR request too long\n", 21);
+            break;
+        }
+        if(!daemon_answer(d, conn->fd, line)) {
+            break;
+        }
+    }
+    free(line);
+    pthread_mutex_lock(&d->lock);
+    for(int i = 0; i < d->conn_count; i++) {
+        if(d->conns[i] == conn->fd) {
+            d->conns[i] = d->conns[--d->conn_count];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    fclose(in);
+    free(conn);
+    return NULL;
+}
+// Connection thread: answer requests until the client disconnects or
+// the daemon stops.
+
+int rcv_daemon_serve_r(rcv_ctx_t *ctx, char *sockpath, int nthreads){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(ctx->out, "ERROR: socket path '%s' is too long\n", sockpath);
+        return 0;
+    }
+    strcpy(addr.sun_path, sockpath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sockpath);                           // a socket left by an earlier daemon
+    if(fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(ctx->out, "ERROR: couldn't listen on '%s'\n", sockpath);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    daemon_t d = {.ctx = ctx, .listen_fd = fd, .nthreads = nthreads};
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+
+    while(1) {
+        int cfd = accept(fd, NULL, NULL);
+        pthread_mutex_lock(&d.lock);
+        if(d.stop) {
+            pthread_mutex_unlock(&d.lock);
+            if(cfd >= 0) {
+                close(cfd);
+            }
+            break;
+        }
+        if(cfd < 0) {
+            pthread_mutex_unlock(&d.lock);
+            continue;
+        }
+        if(d.conn_count == d.conn_cap) {
+            d.conn_cap = d.conn_cap == 0 ? 16 : d.conn_cap * 2;
+            d.conns = realloc(d.conns, sizeof(int) * d.conn_cap);
+        }
+        d.conns[d.conn_count++] = cfd;
+        pthread_mutex_unlock(&d.lock);
+        daemon_conn_t *conn = malloc(sizeof(daemon_conn_t));
+        conn->d = &d;
+        conn->fd = cfd;
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemon_conn, conn);
+        pthread_detach(thread);
+    }
+
+    pthread_mutex_lock(&d.lock);                // end idle connections and wait for all
+    for(int i = 0; i < d.conn_count; i++) {
+        shutdown(d.conns[i], SHUT_RD);
+    }
+    while(d.conn_count > 0) {
+        pthread_cond_wait(&d.cond, &d.lock);
+    }
+    pthread_mutex_unlock(&d.lock);
+    close(fd);
+    unlink(sockpath);
+    while(d.contests != NULL) {
+        daemon_contest_t *c = d.contests;
+        d.contests = c->next;
+        daemon_unload(&d, c);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+    }
+    free(d.conns);
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+    return 1;
+}
+// Serve requests on Unix domain socket `sockpath`, replacing any stale
+// socket there, until a shutdown request, with one thread per
+// connection. Each vote file is parsed on its first request and kept
+// with a snapshot of its loaded state; each distinct request on it is
+// computed once from that state and its output kept, so repeated
+// requests are answered from memory. A file is reloaded, and its
+// answers dropped, when its size or modification time changes. Errors
+// are printed to ctx->out. Returns 0 if the socket couldn't be set up.
+
+static int client_connect(char *sockpath){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sockpath);
+    for(int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return -1;
+        }
+        if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        if(errno != ENOENT && errno != ECONNREFUSED) {
+            return -1;
+        }
+        usleep(20000);
+    }
+    return -1;
+}
+// Connect to the daemon, retrying for up to 2 seconds while it starts.
+
+typedef struct {                // Load shared by client connections, see rcv_daemon_request()
+  char *sockpath;
+  char *request;
+  int repeat;                   // requests per connection
+  FILE *out;                    // where the first answer is written, NULL for none
+  char *failed;                 // [task] set if any of its requests failed
+} client_job_t;
+
+static void client_task(void *arg, int task, int worker){
+    client_job_t *job = arg;
+    int fd = client_connect(job->sockpath);
+    if(fd < 0) {
+        job->failed[task] = 1;
+        return;
+    }
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL, *body = NULL;
+    size_t cap = 0, body_cap = 0;
+    size_t reqlen = strlen(job->request);
+    for(int i = 0; i < job->repeat; i++) {
+        if(!daemon_send(fd, job->request, reqlen) || getline(&line, &cap, in) <= 0) {
+            job->failed[task] = 1;
+            break;
+        }
+        if(strncmp(line, "OK ", 3) != 0) {
+            if(job->out != NULL && task == 0 && i == 0) {
+                fputs(line, job->out);
+            }
+            job->failed[task] = 1;
+            break;
+        }
+        size_t len = strtoul(line + 3, NULL, 10);
+        if(len > body_cap) {
+            body_cap = len;
+            body = realloc(body, body_cap);
+        }
+        if(fread(body, 1, len, in) != len) {
+            job->failed[task] = 1;
+            break;
+        }
+        if(job->out != NULL && task == 0 && i == 0) {
+            fwrite(body, 1, len, job->out);
+        }
+    }
+    free(line);
+    free(body);
+    fclose(in);
+}
+// One client connection sending the request `repeat` times, reading
+// each answer in full.
+
+int rcv_daemon_request_r(rcv_ctx_t *ctx, char *sockpath, char *request, int clients, int repeat){
+    char *line = malloc(strlen(request) + 2);
+    sprintf(line, "%s\n", request);
+    client_job_t job = {.sockpath = sockpath, .request = line, .repeat = repeat};
+    job.out = clients == 1 && repeat == 1 ? ctx->out : NULL;
+    job.failed = calloc(clients, 1);
+    double start = rcv_now();
+    rcv_pool_run(clients, clients, client_task, &job);
+    double secs = rcv_now() - start;
+    int failed = 0;
+    for(int i = 0; i < clients; i++) {
+        failed |= job.failed[i];
+    }
+    free(job.failed);
+    free(line);
+    if(job.out == NULL && !failed) {
+        long total = (long) clients * repeat;
+        fprintf(ctx->out, "%ld requests on %d connections in %.3f s: %.1f requests per second\n",
+                total, clients, secs, secs > 0 ? total / secs : 0.0);
+    }
+    if(failed && job.out == NULL) {
+        fprintf(ctx->out, "ERROR: request to '%s' failed\n", sockpath);
+    }
+    return !failed;
+}
+// Send `request` to the daemon listening on `sockpath`. For a single
+// request the answer's output, or its ERR line, is printed to ctx->out.
+// Otherwise, as a load test, `clients` connections in parallel each
+// send it `repeat` times and the request rate is printed instead.
+// Returns 1 if every request was answered with OK.
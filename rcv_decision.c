@@ -0,0 +1,279 @@
+// rcv_decision.c: Decision log of an election recording each round's
+// counts and the candidates it eliminated, and a verifier which checks
+// such a log against the ballots one round at a time.
+//
+// The log is text so it can be read and published as is:
+//
+//   RCV DECISIONS 4
+//   Francis Claire Heather Viktor
+//   ROUND 1 COUNTS 4 2 5 1 INVALID 0 ELIMINATED 3
+//   ROUND 2 COUNTS 5 2 5 - INVALID 0 ELIMINATED 1
+//   ROUND 3 COUNTS 7 - 5 - INVALID 0 ELIMINATED 2
+//   RESULT WINNER 0
+//
+// COUNTS has one entry per candidate, - for those already dropped.
+// ELIMINATED lists the candidates marked MINVOTES at the end of the
+// round, who are dropped at the start of the next; the RESULT line is
+// "RESULT WINNER c", "RESULT TIE" or "RESULT ERROR".
+
+#include "rcv.h"
+
+static void decision_round(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    FILE *log = arg;
+    fprintf(log, "ROUND %d COUNTS", round);
+    for(int c = 0; c < tally->candidate_count; c++) {
+        if(tally->candidate_status[c] == CAND_DROPPED) {
+            fprintf(log, " -");
+        }
+        else {
+            fprintf(log, " %d", tally->candidate_vote_counts[c]);
+        }
+    }
+    fprintf(log, " INVALID %d ELIMINATED", tally->invalid_vote_count);
+    for(int c = 0; c < tally->candidate_count; c++) {
+        if(tally->candidate_status[c] == CAND_MINVOTES) {
+            fprintf(log, " %d", c);
+        }
+    }
+    fprintf(log, "\n");
+}
+// Round hook writing the ROUND line of the log.
+
+int rcv_decisions_write_r(rcv_ctx_t *ctx, tally_t *tally, char *fname){
+    FILE *log = fopen(fname, "w");
+    if(log == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return TALLY_ERROR;
+    }
+    fprintf(log, "RCV DECISIONS %d\n", tally->candidate_count);
+    for(int c = 0; c < tally->candidate_count; c++) {
+        fprintf(log, "%s%s", c > 0 ? " " : "", tally->candidate_names[c]);
+    }
+    fprintf(log, "\n");
+
+    rcv_ctx_t run = *ctx;
+    rcv_ctx_add_round_hook(&run, decision_round, log);
+    int condition = tally_election_r(&run, tally);
+    ctx->stats = run.stats;
+    if(condition == TALLY_WINNER) {
+        fprintf(log, "RESULT WINNER %d\n", run.stats.winner);
+    }
+    else {
+        fprintf(log, "RESULT %s\n", condition == TALLY_TIE ? "TIE" : "ERROR");
+    }
+    fclose(log);
+    return condition;
+}
+// Run the election on `tally` exactly as tally_election_r() while
+// writing its decision log to `fname`. Returns the final condition, or
+// TALLY_ERROR without running anything if the log can't be created,
+// after printing the usual "ERROR: couldn't open file" message.
+
+typedef struct {                // One round read back from a decision log
+  int counts[MAX_CANDIDATES];   // -1 for dropped candidates
+  int invalid;
+  char eliminated[MAX_CANDIDATES];
+  char dropped[MAX_CANDIDATES]; // dropped before the round, derived from earlier rounds
+  char ok;                      // set by the verifier
+  char msg[MAX_NAME + 128];     // first problem found in the round
+} decision_round_t;
+
+typedef struct {                // Arguments shared by all round verifications
+  rcv_ballots_t *ballots;
+  decision_round_t *rounds;     // rounds[r-1] is round r
+  char (*names)[MAX_NAME];
+} decision_job_t;
+
+static void decision_verify_round(void *arg, int r, int worker){
+    decision_job_t *job = arg;
+    decision_round_t *round = &job->rounds[r];
+    int n = job->ballots->candidate_count;
+    int counts[MAX_CANDIDATES] = {0};
+    int invalid = 0;
+    for(int b = 0; b < job->ballots->ballot_count; b++) {  // one counting pass
+        vote_t *vote = job->ballots->ballots[b];
+        int p = 0;
+        while(p < n && vote->candidate_order[p] != NO_CANDIDATE &&
+              round->dropped[vote->candidate_order[p]]) {
+            p++;
+        }
+        if(p < n && vote->candidate_order[p] != NO_CANDIDATE) {
+            counts[vote->candidate_order[p]] += vote->weight;
+        }
+        else {
+            invalid += vote->weight;
+        }
+    }
+
+    round->ok = 1;
+    int elim_count = -1;
+    for(int c = 0; c < n && round->ok; c++) {
+        int logged = round->counts[c];
+        if(round->dropped[c] != (logged < 0)) {
+            snprintf(round->msg, sizeof(round->msg), "candidate %d %s should%s be dropped",
+                     c, job->names[c], round->dropped[c] ? "" : " not");
+            round->ok = 0;
+        }
+        else if(!round->dropped[c] && logged != counts[c]) {
+            snprintf(round->msg, sizeof(round->msg), "candidate %d %s logged %d votes, counted %d",
+                     c, job->names[c], logged, counts[c]);
+            round->ok = 0;
+        }
+        else if(round->eliminated[c]) {
+            if(elim_count >= 0 && counts[c] != elim_count) {
+                snprintf(round->msg, sizeof(round->msg), "eliminated candidates have different counts");
+                round->ok = 0;
+            }
+            elim_count = counts[c];
+        }
+    }
+    for(int c = 0; c < n && round->ok; c++) {       // compare eliminated to the rest
+        if(!round->dropped[c] && !round->eliminated[c] && elim_count >= 0 && counts[c] <= elim_count) {
+            snprintf(round->msg, sizeof(round->msg),
+                     "candidate %d %s has %d votes but was not eliminated", c, job->names[c], counts[c]);
+            round->ok = 0;
+        }
+    }
+    if(round->ok && elim_count < 0) {
+        snprintf(round->msg, sizeof(round->msg), "no candidate eliminated");
+        round->ok = 0;
+    }
+    if(round->ok && round->invalid != invalid) {
+        snprintf(round->msg, sizeof(round->msg), "logged %d invalid votes, counted %d",
+                 round->invalid, invalid);
+        round->ok = 0;
+    }
+}
+// Verify round r+1 from its dropped candidates alone: count each
+// ballot for its first ranked candidate not yet dropped, then check the
+// counts and invalid votes against the log and that the logged
+// eliminations are exactly the candidates with the fewest votes.
+// Rounds don't depend on each other so they may run in any order.
+
+static int decision_read(FILE *log, tally_t *tally, decision_round_t **rounds_out, int *result){
+    int n;
+    if(fscanf(log, "RCV DECISIONS %d", &n) != 1 || n != tally->candidate_count) {
+        return -1;
+    }
+    for(int c = 0; c < n; c++) {
+        char name[MAX_NAME];
+        if(fscanf(log, "%127s", name) != 1 || strcmp(name, tally->candidate_names[c]) != 0) {
+            return -1;
+        }
+    }
+    int cap = 8, count = 0;
+    decision_round_t *rounds = calloc(cap, sizeof(decision_round_t));
+    char word[MAX_NAME];
+    while(fscanf(log, "%127s", word) == 1 && strcmp(word, "ROUND") == 0) {
+        if(count == cap) {
+            cap *= 2;
+            rounds = realloc(rounds, sizeof(decision_round_t) * cap);
+        }
+        decision_round_t *round = &rounds[count];
+        memset(round, 0, sizeof(*round));
+        int num;
+        if(fscanf(log, "%d COUNTS", &num) != 1 || num != count + 1) {
+            break;
+        }
+        for(int c = 0; c < n; c++) {
+            if(fscanf(log, "%127s", word) != 1) {
+                break;
+            }
+            round->counts[c] = strcmp(word, "-") == 0 ? -1 : atoi(word);
+        }
+        if(fscanf(log, " INVALID %d ELIMINATED", &round->invalid) != 1) {
+            break;
+        }
+        int c;
+        while(fscanf(log, "%d", &c) == 1) {
+            if(c >= 0 && c < n) {
+                round->eliminated[c] = 1;
+            }
+        }
+        if(count > 0) {                         // dropped = earlier eliminations
+            for(int i = 0; i < n; i++) {
+                decision_round_t *prev = &rounds[count - 1];
+                round->dropped[i] = prev->dropped[i] || prev->eliminated[i];
+            }
+        }
+        count++;
+    }
+    *result = NO_CANDIDATE - 1;                 // no RESULT line
+    if(strcmp(word, "RESULT") == 0 && fscanf(log, "%127s", word) == 1) {
+        if(strcmp(word, "WINNER") == 0 && fscanf(log, "%d", result) == 1) {
+        }
+        else if(strcmp(word, "TIE") == 0) {
+            *result = NO_CANDIDATE;
+        }
+    }
+    *rounds_out = rounds;
+    return count;
+}
+// Parse a decision log whose header must match the tally's candidates.
+// Returns the number of rounds read into a malloc()'d array, or -1 if
+// the header doesn't match. `result` gets the logged winner,
+// NO_CANDIDATE for a tie or below that if there is no valid result.
+
+int rcv_decisions_verify_r(rcv_ctx_t *ctx, tally_t *tally, char *fname, int nthreads){
+    FILE *log = fopen(fname, "r");
+    if(log == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return 0;
+    }
+    decision_round_t *rounds = NULL;
+    int result;
+    int count = decision_read(log, tally, &rounds, &result);
+    fclose(log);
+    if(count < 0) {
+        fprintf(ctx->out, "ERROR: decision log '%s' is not for this election\n", fname);
+        return 0;
+    }
+
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    decision_job_t job = {.ballots = &ballots, .rounds = rounds, .names = tally->candidate_names};
+    rcv_pool_run(nthreads, count, decision_verify_round, &job);
+
+    int ok = count > 0;
+    for(int r = 0; r < count; r++) {
+        if(rounds[r].ok) {
+            fprintf(ctx->out, "ROUND %d: OK\n", r + 1);
+        }
+        else {
+            fprintf(ctx->out, "ROUND %d: MISMATCH %s\n", r + 1, rounds[r].msg);
+            ok = 0;
+        }
+    }
+
+    if(ok) {                                    // the final eliminations decide the result
+        int n = tally->candidate_count, left = 0, winner = NO_CANDIDATE;
+        decision_round_t *last = &rounds[count - 1];
+        for(int c = 0; c < n; c++) {
+            if(!last->dropped[c] && !last->eliminated[c]) {
+                left++;
+                winner = c;
+            }
+        }
+        int expect = left == 1 ? winner : left == 0 ? NO_CANDIDATE : NO_CANDIDATE - 1;
+        if(left > 1 || expect != result) {
+            fprintf(ctx->out, "RESULT: MISMATCH logged result does not follow from round %d\n", count);
+            ok = 0;
+        }
+        else {
+            fprintf(ctx->out, "RESULT: OK\n");
+        }
+    }
+    fprintf(ctx->out, "%s: %d rounds checked\n", ok ? "VERIFIED" : "FAILED", count);
+    free(rounds);
+    rcv_ballots_free(&ballots);
+    return ok;
+}
+// Verify the decision log `fname` of an election on `tally`'s ballots
+// without re-running the election. Each round is checked on its own
+// from the candidates dropped before it, taken from the log's earlier
+// eliminations, with a single counting pass over the ballots, so
+// rounds are verified in parallel on up to `nthreads` threads. Prints
+// "ROUND N: OK" or "ROUND N: MISMATCH ..." with the first problem found
+// for each round, whether the logged result follows from the last
+// round, then "VERIFIED: N rounds checked" or "FAILED: ...". Returns 1
+// if everything matched, 0 otherwise.
@@ -10,20 +10,96 @@ int LOG_LEVEL = 0;
 // trigger additional output to be printed during certain
 // functions. This output is useful to monitor and audit how election
 // results are calculated.
+//
+// LOG_LEVEL is only consulted by the original function signatures
+// below which are thin wrappers around the reentrant *_r() versions;
+// those take an rcv_ctx_t carrying the log level instead.
+
+static char *bad_ballot_names[BALLOT_REASONS] = {
+  "ok", "out of range", "duplicate ranking", "short ballot", "stray token", "too many rankings",
+  "bad weight",
+};
+// Descriptions of the BALLOT_* reasons in error messages and reports.
+
+////////////////////////////////////////////////////////////////////////////////
+// ELECTION CONTEXT
+
+void rcv_ctx_init(rcv_ctx_t *ctx){
+    memset(ctx, 0, sizeof(rcv_ctx_t));
+    ctx->log_level = 0;
+    ctx->out = stdout;
+    ctx->alloc = malloc;
+    ctx->dealloc = free;
+    ctx->validate = RCV_VALIDATE_INVALID;
+}
+// Initialize an election context to defaults: no logging, output to
+// stdout, malloc()/free() for allocation, bad ballots counted as
+// invalid votes, all stats zeroed. Fields may
+// be changed after this call to redirect output (e.g. to a file or
+// open_memstream() buffer) or raise the log level.
+
+int rcv_ctx_add_round_hook(rcv_ctx_t *ctx, rcv_round_fn fn, void *arg){
+    if(ctx->round_hook_count >= RCV_MAX_HOOKS) {
+        return 0;
+    }
+    ctx->round_hooks[ctx->round_hook_count] = fn;
+    ctx->round_hook_args[ctx->round_hook_count] = arg;
+    ctx->round_hook_count++;
+    return 1;
+}
+// Register `fn` to be called as fn(ctx, tally, round, arg) at the end
+// of every round of tally_election_r(), once the candidates to drop in
+// the next round are marked CAND_MINVOTES. Hooks run in registration
+// order. Returns 0 if RCV_MAX_HOOKS are already registered.
+
+int rcv_ctx_add_transfer_hook(rcv_ctx_t *ctx, rcv_transfer_fn fn, void *arg){
+    if(ctx->transfer_hook_count >= RCV_MAX_HOOKS) {
+        return 0;
+    }
+    ctx->transfer_hooks[ctx->transfer_hook_count] = fn;
+    ctx->transfer_hook_args[ctx->transfer_hook_count] = arg;
+    ctx->transfer_hook_count++;
+    return 1;
+}
+// Register `fn` to be called as fn(ctx, tally, vote, from, to, arg)
+// each time tally_transfer_first_vote_r() moves a vote, after it has
+// been added to its new list. `to` is NO_CANDIDATE when the vote has
+// no active candidate left and went to the invalid votes. Hooks run in
+// registration order. Returns 0 if RCV_MAX_HOOKS are already
+// registered.
+
+rcv_ctx_t rcv_ctx_global(){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    ctx.log_level = LOG_LEVEL;
+    return ctx;
+}
+// Returns a context mirroring the process-wide settings: log level
+// taken from the LOG_LEVEL global, output to stdout. Used by the
+// wrapper functions that preserve the original signatures. Stats
+// accumulated in this context are discarded when the wrapper returns.
 
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 1 Functions
 
-void vote_print(vote_t *vote){
-    printf("#%04d:", vote->id);
+void vote_print_r(rcv_ctx_t *ctx, vote_t *vote){
+    fprintf(ctx->out, "#%04d:", vote->id);
     for(int i = 0; vote->candidate_order[i] != NO_CANDIDATE; i++) {
         if(i == vote->pos) {
-            printf("<%d>", vote->candidate_order[i]);
+            fprintf(ctx->out, "<%d>", vote->candidate_order[i]);
         }
         else {
-            printf(" %d ", vote->candidate_order[i]);
+            fprintf(ctx->out, " %d ", vote->candidate_order[i]);
         }
     }
+    if(vote->weight > 1) {
+        fprintf(ctx->out, " x%d", vote->weight);
+    }
+}
+
+void vote_print(vote_t *vote){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    vote_print_r(&ctx, vote);
 }
 // PROBLEM 1: Print a textual representation of the vote. A vote which
 // is defined as follows
@@ -47,6 +123,9 @@ void vote_print(vote_t *vote){
 // printing should terminate there. The `next` field is not printed
 // and not used during printing.
 //
+// WEIGHTS: A vote standing for more than one ballot ends with its
+// weight as in "#0017: 3 <0> 2  1  x250".
+//
 // NOTE: For maximum flexibility, NO NEWLINE is printed at the end of
 // the vote which allows several votes to printed on the same line if
 // needed.
@@ -55,10 +134,15 @@ int vote_next_candidate(vote_t *vote, char *candidate_status){
     if((vote->candidate_order[vote->pos] != NO_CANDIDATE) && (vote->candidate_order[vote->pos] 
     < MAX_CANDIDATES)){
         vote->pos += 1;
-        while(candidate_status[vote->candidate_order[vote->pos]] != CAND_ACTIVE){
+        while(vote->pos < MAX_CANDIDATES - 1 && vote->candidate_order[vote->pos] != NO_CANDIDATE &&
+              candidate_status[vote->candidate_order[vote->pos]] != CAND_ACTIVE){
             vote->pos += 1;  
         }
-        return vote->candidate_order[(vote->pos)];
+        int next = vote->candidate_order[vote->pos];
+        if(next == NO_CANDIDATE || candidate_status[next] != CAND_ACTIVE) {
+            return NO_CANDIDATE;
+        }
+        return next;
     }
     return NO_CANDIDATE;
 }
@@ -89,8 +173,8 @@ int vote_next_candidate(vote_t *vote, char *candidate_status){
 // - v is {.pos=4, .candidate_order={2, 0, 3, 1, NO_CANDIDATE}}
 // - pos has not changed as it referred to NO_CANDIDATE already
 
-void tally_print_table(tally_t *tally){
-    printf("NUM COUNT %%PERC S NAME\n");
+void tally_print_table_r(rcv_ctx_t *ctx, tally_t *tally){
+    fprintf(ctx->out, "NUM COUNT %%PERC S NAME\n");
 
     
     int total_votes = 0;
@@ -98,6 +182,9 @@ void tally_print_table(tally_t *tally){
     for(int i = 0; i < tally->candidate_count; i++){
         total_votes += curr[i];
     }
+    if(total_votes == 0) {      // every vote invalid: show 0.0 rather than nan
+        total_votes = 1;
+    }
 
     for(int i = 0; i < tally->candidate_count; i++){
         char c = 'D';
@@ -111,13 +198,21 @@ void tally_print_table(tally_t *tally){
         double percent = (((double)(tally->candidate_vote_counts[i]) / total_votes) * 100);
 
         if (c == 'D'){
-            printf("%3d %5c %5c %c %s\n", i, '-', '-', c, tally->candidate_names[i]);
+            fprintf(ctx->out, "%3d %5c %5c %c %s\n", i, '-', '-', c, tally->candidate_names[i]);
         }
         else {
-            printf("%3d %5d  %.1f %c %s\n", i, tally->candidate_vote_counts[i], percent, 
+            fprintf(ctx->out, "%3d %5d %5.1f %c %s\n", i, tally->candidate_vote_counts[i], percent, 
             c, tally->candidate_names[i]);  
         }
     }
+    if(tally->invalid_vote_count > 0) {
+        fprintf(ctx->out, "Invalid vote count: %d\n", tally->invalid_vote_count);
+    }
+}
+
+void tally_print_table(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_print_table_r(&ctx, tally);
 }
 // PROBLEM 1: Print a table showing the vote breakdown for the
 // tally. The table appears like the following.
@@ -164,8 +259,8 @@ void tally_print_table(tally_t *tally){
 // If there are no valid votes, this function prints the percentage
 // for each candidate as 0.0% which is a special case.
 
-void tally_set_minvote_candidates(tally_t *tally){
-    int min = 999;
+void tally_set_minvote_candidates_r(rcv_ctx_t *ctx, tally_t *tally){
+    int min = INT_MAX;
     int min_index[tally->candidate_count];
     int count = -1;
     for(int i = 0 ; i < tally->candidate_count; i++) {
@@ -180,18 +275,23 @@ void tally_set_minvote_candidates(tally_t *tally){
             tally->candidate_status[min_index[count]] = CAND_MINVOTES;
         }
     }
-    if(LOG_LEVEL >= LOG_MINVOTE) {
-        printf("LOG: MIN VOTE count is %d\n", min);
+    if(ctx->log_level >= LOG_MINVOTE) {
+        fprintf(ctx->out, "LOG: MIN VOTE count is %d\n", min);
         for(int i = 0; i <= count; i++) {
-            printf("LOG: MIN VOTE COUNT for candidate %d: %s\n", min_index[i],
+            fprintf(ctx->out, "LOG: MIN VOTE COUNT for candidate %d: %s\n", min_index[i],
             tally->candidate_names[min_index[i]]);
         }
     }
-    else if(min == 999) {
-        printf("LOG: No MIN VOTE count found");
+    else if(min == INT_MAX) {
+        fprintf(ctx->out, "LOG: No MIN VOTE count found");
     }
 
 }
+
+void tally_set_minvote_candidates(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_set_minvote_candidates_r(&ctx, tally);
+}
 // PROBLEM 1: Scans the vote counts of candidates and sets the status
 // of candidates with the minimum votes to CAND_MINVOTES excluding
 // those with status CAND_DROPPED. All candidates with the minumum
@@ -280,31 +380,48 @@ int tally_condition(tally_t *tally){
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 2 Functions
 
-vote_t *vote_make_empty(){
-    vote_t *curr = malloc(sizeof(vote_t));
+vote_t *vote_make_empty_r(rcv_ctx_t *ctx){
+    vote_t *curr = ctx->alloc(sizeof(vote_t));
     curr->id = -1;
     curr->pos = -1;
+    curr->weight = 1;
     for(int i = 0; i < MAX_CANDIDATES; i++) {
         curr->candidate_order[i] = NO_CANDIDATE;
     }
     curr->next = NULL;
     return curr;
 }
+
+vote_t *vote_make_empty(){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    return vote_make_empty_r(&ctx);
+}
 // PROBLEM 2: Allocates a vote on the heap using malloc() and
 // intitializes its id/pos fields to be -1, all of the entries in
 // its candidate_order[] array to be NO_CANDIDATE, and the next field
 // to NULL. Returns a pointer to that vote.
 
-void tally_free(tally_t *tally){
-    for(int i = 0; i < tally->candidate_count; i ++) {
+void tally_free_r(rcv_ctx_t *ctx, tally_t *tally){
+    for(int i = 0; i < tally->candidate_count && i < MAX_CANDIDATES; i ++) {
         vote_t *curr = tally->candidate_votes[i];
         while(curr != NULL){
             vote_t *next_c = curr->next;
-            free(curr);
+            ctx->dealloc(curr);
             curr = next_c;
         }
     }
-    free(tally);
+    vote_t *curr = tally->invalid_votes;
+    while(curr != NULL){
+        vote_t *next_c = curr->next;
+        ctx->dealloc(curr);
+        curr = next_c;
+    }
+    ctx->dealloc(tally);
+}
+
+void tally_free(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_free_r(&ctx, tally);
 }
 // PROBLEM 2: De-allocates a tally and all its linked votes from the
 // heap using free(). The entirety of the candidate_votes[] array is
@@ -315,12 +432,23 @@ void tally_free(tally_t *tally){
 // MAKEUP CREDIT: In addition to the candidate vote lists, also
 // de-allocates the invalid vote list.
 
-void tally_add_vote(tally_t *tally, vote_t *vote){
+void tally_add_vote_r(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote){
     int cand_index = vote->candidate_order[vote->pos];
+    ctx->stats.votes_added++;
+    if(cand_index == NO_CANDIDATE) {
+        vote->next = tally->invalid_votes;
+        tally->invalid_votes = vote;
+        tally->invalid_vote_count += vote->weight;
+        return;
+    }
     vote->next = tally->candidate_votes[cand_index];
     tally->candidate_votes[cand_index] = vote;
-    tally->candidate_vote_counts[cand_index] += 1;
-           
+    tally->candidate_vote_counts[cand_index] += vote->weight;
+}
+
+void tally_add_vote(tally_t *tally, vote_t *vote){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_add_vote_r(&ctx, tally, vote);
 }
 // PROBLEM 2: Add the given vote to the given tally. The vote is
 // assigned to candidate indicated by the vote->pos field and
@@ -332,22 +460,38 @@ void tally_add_vote(tally_t *tally, vote_t *vote){
 //
 // MAKEUP CREDIT: Votes whose preference is NO_CANDIDATE are prepended
 // to the invalid_votes list with the invalid_vote_count incrementing.
+//
+// WEIGHTS: Counts are sums of vote weights, so a vote standing for
+// many identical ballots adds its weight rather than 1.
 
-void tally_print_votes(tally_t *tally){
+void tally_print_votes_r(rcv_ctx_t *ctx, tally_t *tally){
     for(int i = 0; i < tally->candidate_count; i++) {
-        printf("VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
+        fprintf(ctx->out, "VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
         vote_t *curr = tally->candidate_votes[i];
         while(curr != NULL){
             if(curr->candidate_order[curr->pos] == i){
-                printf("  ");
-                vote_print(curr);
-                printf("\n");
+                fprintf(ctx->out, "  ");
+                vote_print_r(ctx, curr);
+                fprintf(ctx->out, "\n");
             }
             curr = curr->next;
         }
-        printf("%d votes total\n", tally->candidate_vote_counts[i]);
+        fprintf(ctx->out, "%d votes total\n", tally->candidate_vote_counts[i]);
     }
-        
+    if(tally->invalid_vote_count > 0) {
+        fprintf(ctx->out, "INVALID VOTES\n");
+        for(vote_t *curr = tally->invalid_votes; curr != NULL; curr = curr->next) {
+            fprintf(ctx->out, "  ");
+            vote_print_r(ctx, curr);
+            fprintf(ctx->out, "\n");
+        }
+        fprintf(ctx->out, "%d votes total\n", tally->invalid_vote_count);
+    }
+}
+
+void tally_print_votes(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_print_votes_r(&ctx, tally);
 }
 // PROBLEM 2: Prints out the votes for each candidate in the tally
 // which produces output like the following:
@@ -382,7 +526,7 @@ void tally_print_votes(tally_t *tally){
 // format as above and ending with a line showing the total invalid
 // votes.
 
-void tally_transfer_first_vote(tally_t *tally, int candidate_index){
+void tally_transfer_first_vote_r(rcv_ctx_t *ctx, tally_t *tally, int candidate_index){
     if(tally->candidate_vote_counts[candidate_index] == 0) {
         return;
     }
@@ -391,19 +535,36 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index){
     if(curr != NULL){
         if(curr->candidate_order[curr->pos] == candidate_index){
             int next_cand_index = vote_next_candidate(curr, tally->candidate_status);
-            tally->candidate_vote_counts[candidate_index]--;
-            tally_add_vote(tally, curr);
-
-            if(LOG_LEVEL >= LOG_VOTE_TRANSFERS) {
-                printf("LOG: Transferred Vote ");
-                vote_print(curr);
-                printf("from %d %s to %d %s\n", candidate_index, tally->candidate_names[candidate_index],
-                next_cand_index, tally->candidate_names[next_cand_index]);
+            tally->candidate_vote_counts[candidate_index] -= curr->weight;
+            tally_add_vote_r(ctx, tally, curr);
+            ctx->stats.votes_added--;       // a transfer, not a new vote
+            ctx->stats.votes_transferred++;
+            for(int i = 0; i < ctx->transfer_hook_count; i++) {
+                ctx->transfer_hooks[i](ctx, tally, curr, candidate_index, next_cand_index,
+                                       ctx->transfer_hook_args[i]);
+            }
+
+            if(ctx->log_level >= LOG_VOTE_TRANSFERS) {
+                fprintf(ctx->out, "LOG: Transferred Vote ");
+                vote_print_r(ctx, curr);
+                if(next_cand_index == NO_CANDIDATE) {
+                    fprintf(ctx->out, " from %d %s to Invalid Votes\n", candidate_index,
+                            tally->candidate_names[candidate_index]);
+                }
+                else {
+                    fprintf(ctx->out, " from %d %s to %d %s\n", candidate_index, tally->candidate_names[candidate_index],
+                    next_cand_index, tally->candidate_names[next_cand_index]);
+                }
             }   
            }
     }
 
 }
+
+void tally_transfer_first_vote(tally_t *tally, int candidate_index){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_transfer_first_vote_r(&ctx, tally, candidate_index);
+}
 // PROBLEM 2: Transfer the first vote for the candidate at
 // `candidate_index` to the next candidate indicated on the vote. This
 // is usually done when the indicated candidate is being dropped from
@@ -442,22 +603,29 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index){
 // vote_next_candidate() are moved to the invalid_votes list with a
 // message to that effect printed:
 // "Transferred Vote #0002: 1 <0> 2  3  from 1 Claire to Invalid Votes"
+//
+// WEIGHTS: The whole weight of the vote moves with it, so a vote
+// standing for many ballots transfers them all at once.
 
-void tally_drop_minvote_candidates(tally_t *tally){
+void tally_drop_minvote_candidates_r(rcv_ctx_t *ctx, tally_t *tally){
     for(int i = 0; i < tally->candidate_count; i++) {
         if(tally->candidate_status[i] == CAND_MINVOTES) {
-            int count = 0;
-            while(count < MAX_CANDIDATES){
-                tally_transfer_first_vote(tally, i);
-                count++;
+            while(tally->candidate_vote_counts[i] > 0 && tally->candidate_votes[i] != NULL){
+                tally_transfer_first_vote_r(ctx, tally, i);
             }
             tally->candidate_status[i] = CAND_DROPPED;
-            if(LOG_LEVEL >= LOG_DROP_MINVOTES) {
-                printf("LOG: Dropped Candidate %d: %s\n", i, tally->candidate_names[i]);
+            ctx->stats.candidates_dropped++;
+            if(ctx->log_level >= LOG_DROP_MINVOTES) {
+                fprintf(ctx->out, "LOG: Dropped Candidate %d: %s\n", i, tally->candidate_names[i]);
             }
         }
     }
 }
+
+void tally_drop_minvote_candidates(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_drop_minvote_candidates_r(&ctx, tally);
+}
 // PROBLEM 2: All candidates with the status CAND_MINVOTES have their
 // votes transferred to other candidates via repeated calls to
 // tally_transfer_first_vote(). Those with status CAND_MINVOTE are
@@ -469,34 +637,57 @@ void tally_drop_minvote_candidates(tally_t *tally){
 // "LOG: Dropped Candidate XX: YY"
 // with XX and YY as the candidate index and name respectively.
 
-void tally_election(tally_t *tally){
-    int round = 0;
+int tally_election_r(rcv_ctx_t *ctx, tally_t *tally){
+    return tally_election_resume_r(ctx, tally, 0);
+}
+
+int tally_election_resume_r(rcv_ctx_t *ctx, tally_t *tally, int round){
+    ctx->stats.winner = NO_CANDIDATE;
     while(tally_condition(tally) == TALLY_CONTINUE) {
-        printf("=== ROUND %d ===\n", ++round);
-        tally_drop_minvote_candidates(tally);
-        tally_print_table(tally);
-        if(LOG_LEVEL >= LOG_SHOWVOTES) {
-            tally_print_votes(tally);
+        fprintf(ctx->out, "=== ROUND %d ===\n", ++round);
+        tally_drop_minvote_candidates_r(ctx, tally);
+        tally_print_table_r(ctx, tally);
+        if(ctx->log_level >= LOG_SHOWVOTES) {
+            tally_print_votes_r(ctx, tally);
+        }
+        tally_set_minvote_candidates_r(ctx, tally);
+        for(int i = 0; i < ctx->round_hook_count; i++) {
+            ctx->round_hooks[i](ctx, tally, round, ctx->round_hook_args[i]);
         }
-        tally_set_minvote_candidates(tally);
     }
-    if(tally_condition(tally) == TALLY_WINNER) {
+    ctx->stats.rounds = round;
+    return tally_print_result_r(ctx, tally);
+}
+
+int tally_print_result_r(rcv_ctx_t *ctx, tally_t *tally){
+    ctx->stats.winner = NO_CANDIDATE;
+    int condition = tally_condition(tally);
+    if(condition == TALLY_WINNER) {
         for(int i = 0; i < tally->candidate_count; i++){
             if(tally->candidate_status[i] == CAND_ACTIVE) {
-                printf("Winner: %s (candidate %d)\n", tally->candidate_names[i], i);
+                fprintf(ctx->out, "Winner: %s (candidate %d)\n", tally->candidate_names[i], i);
+                ctx->stats.winner = i;
                 break;
             }
         }
     }
-    else if(tally_condition(tally) == TALLY_TIE) {
-        printf("Multiway Tie Between:\n");
+    else if(condition == TALLY_TIE) {
+        fprintf(ctx->out, "Multiway Tie Between:\n");
         for(int i = 0; i < tally->candidate_count; i++){
             if(tally->candidate_status[i] == CAND_MINVOTES) {
-                printf("%s (candidate %d)\n", tally->candidate_names[i], i);
+                fprintf(ctx->out, "%s (candidate %d)\n", tally->candidate_names[i], i);
             }
          } 
     }
+    return condition;
+}
+// Print the result of a finished election, the winner or the members
+// of a tie, as the end of tally_election_r() does, recording the
+// winner in ctx->stats. Returns the condition of the tally.
 
+void tally_election(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_election_r(&ctx, tally);
 }
 // PROBLEM 2: Executes an election on the given tally.  Repeatedly
 // performs the following operations.
@@ -554,44 +745,116 @@ void tally_election(tally_t *tally){
 //   3     -     - D Viktor
 // Winner: Francis (candidate 0)
 //
+// tally_election_r() additionally returns the final condition of the
+// tally and records the round count and winner index (NO_CANDIDATE on
+// a tie or error) in ctx->stats. After each round's MINVOTE candidates
+// are set, every round hook registered with rcv_ctx_add_round_hook()
+// is called with the tally and round number.
+//
+// tally_election_resume_r() continues an election whose first `round`
+// rounds have already been run, as when the tally was restored to its
+// state at the end of that round; round numbering continues from
+// there. tally_election_r() is the same with `round` 0.
 
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 3 FUNCTIONS
 
-tally_t *tally_from_file(char *fname){
-    int success = 0;        // Used to store 1 or 0 if the LOG_LEVEL >= LOG_FILEIO or not 
-    if(LOG_LEVEL >= LOG_FILEIO) {
+tally_t *tally_from_file_r(rcv_ctx_t *ctx, char *fname){
+    int success = 0;        // Used to store 1 or 0 if the log level >= LOG_FILEIO or not 
+    if(ctx->log_level >= LOG_FILEIO) {
         success = 1;
     }
 
-    FILE *file = fopen(fname, "r");     // Opens the file for reading
+    FILE *file = rcv_input_open(fname); // Opens the file, or stdin for "-", read ahead by a thread
     if(file == NULL) {      // Checks whether file couldn't be opened and returns null
-        printf("ERROR: couldn't open file '%s'\n", fname);      
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);      
         return NULL;
     }
 
     if(success == 1) {      // Logs that file was successully opened
-        printf("LOG: File '%s' opened\n", fname);
+        fprintf(ctx->out, "LOG: File '%s' opened\n", fname);
     }
 
-    tally_t *tally = malloc(sizeof(tally_t));       // Mallocs space for tally sctruct pointer
+    tally_t *tally = tally_from_stream_r(ctx, file, fname);
+    if(tally != NULL && ferror(file)) {      // read error or corrupt compressed data: don't use a partial tally
+        fprintf(ctx->out, "ERROR: couldn't read file '%s'\n", fname);
+        tally_free_r(ctx, tally);
+        tally = NULL;
+    }
+    fclose(file);       // Close the file
+    return tally;
+}
+
+tally_t *tally_from_stream_r(rcv_ctx_t *ctx, FILE *file, char *fname){
+    int success = ctx->log_level >= LOG_FILEIO;
+    tally_t *tally = ctx->alloc(sizeof(tally_t));   // Allocates space for tally sctruct pointer
+    memset(tally, 0, sizeof(tally_t));      // ctx->alloc() need not zero memory
+    tally_read_header_r(ctx, tally, file, fname);
+    if(tally_read_votes_r(ctx, tally, file, fname, 1) < 0) {
+        tally_free_r(ctx, tally);
+        return NULL;
+    }
+    if(success == 1) {      // Logs that the end of the file was reached
+        fprintf(ctx->out, "LOG: File '%s' end of file reached\n", fname);
+    }
+    return tally;
+}
+// Reads a complete vote file from an already open stream, logging
+// under the name `fname`, which is how tally_from_file_r() reads once
+// the file is opened. The stream is left open for the caller to
+// close. Allows loading from sources other than a named file such as
+// fmemopen() buffers. Returns NULL if the votes are rejected.
+
+static int vote_space(int ch){
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+static int vote_read_word(FILE *file, char *word, int size, long *lines){
+    int ch = getc_unlocked(file);
+    while(vote_space(ch)) {
+        *lines += ch == '\n';
+        ch = getc_unlocked(file);
+    }
+    int len = 0;
+    while(ch != EOF && !vote_space(ch)) {
+        if(len < size - 1) {
+            word[len++] = ch;
+        }
+        ch = getc_unlocked(file);
+    }
+    word[len] = '\0';
+    if(ch != EOF) {
+        ungetc(ch, file);
+    }
+    return len > 0;
+}
+// Read the next whitespace separated word of a vote file header into
+// `word`, truncated to fit `size` bytes, counting the newlines skipped
+// in `lines` and leaving the whitespace after the word unread. Returns
+// 0 at the end of the file.
+
+void tally_read_header_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, char *fname){
+    int success = ctx->log_level >= LOG_FILEIO;
+    char temp[MAX_NAME];    // Stores each word of the header as it is read
+    ctx->stats.lines = 0;   // Lines are counted from the start of the file
     int num_cand = 0;       // Used to store the number of candidates which is scanned in the next line
-    fscanf(file, "%d", &num_cand);
+    if(vote_read_word(file, temp, MAX_NAME, &ctx->stats.lines)) {
+        num_cand = atoi(temp);
+    }
     tally->candidate_count = num_cand;      // Sets candidate count field in tally struct to the num_cand value
 
     if(success == 1) {      // Logs the number of candidates
-        printf("LOG: File '%s' has %d candidtes\n", fname, num_cand);
+        fprintf(ctx->out, "LOG: File '%s' has %d candidtes\n", fname, num_cand);
     }
 
-    for(int i = 0; i < num_cand; i++) {     // Iterates through list of candidate names
-        char temp[MAX_NAME];        // Stores a temporary char for a name
-        if(fscanf(file, "%s", temp) == EOF) {       // Checks whether the name gets scanned correctly
+    for(int i = 0; i < num_cand && i < MAX_CANDIDATES; i++) {     // Iterates through list of candidate names
+        if(!vote_read_word(file, temp, MAX_NAME, &ctx->stats.lines)) {       // Checks whether the name gets scanned correctly
             break;
         }
         strncpy(tally->candidate_names[i], temp, MAX_NAME);     // Copies the temp variable data to the tally array for candidate names
 
         if(success == 1) {      // Prints a log for the name of a candidate at a specific index
-            printf("LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);      
+            fprintf(ctx->out, "LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);      
         }
 
         tally->candidate_status[i] = CAND_ACTIVE;   // Initializes the status of the candidate at this index
@@ -599,37 +862,307 @@ tally_t *tally_from_file(char *fname){
         tally->candidate_vote_counts[i] = 0;        // Sets the count of the candidate's votes to 0
         
     }
-    
-    int curr_id = 1;        // Used to increment the ID's of all votes
-    int first_ind = 0;      // Used to store the first choice of each voter
-    while(fscanf(file, "%d", &first_ind) != EOF) {      // Loops while the end of the file has not been reached
-        
-        vote_t *vote = vote_make_empty();       // Creates an empty vote
-        
-        vote->id = curr_id++;       // Stores the ID and increments by 1
+}
+// Reads the candidate count and names at the start of a vote file into
+// a zeroed tally, making every candidate active, and logs them as
+// tally_from_file_r() does. Leaves `file` at the first vote and starts
+// counting lines in ctx->stats.lines.
+
+int tally_read_votes_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, char *fname, int first_id){
+    int success = ctx->log_level >= LOG_FILEIO;
+    int curr_id = first_id; // Used to increment the ID's of all votes
+    if(tally->candidate_count < 1 || tally->candidate_count > MAX_CANDIDATES) {
+        fprintf(ctx->out, "ERROR: '%s' has an invalid candidate count %d\n", fname, tally->candidate_count);
+        return -1;
+    }
+    while(1) {
+        vote_t *vote = vote_make_empty_r(ctx);  // Creates an empty vote
+        long line = 0;
+        int reason = tally_read_vote_r(ctx, tally, file, vote, &line);
+        if(reason == EOF) {     // Nothing left in the file
+            ctx->dealloc(vote);
+            break;
+        }
+        vote->id = curr_id++;       // Stores the ID and increments by 1, bad ballots included
         vote->pos = 0;      // Sets the pos of the vote to 0
-        vote->candidate_order[0] = first_ind;       // Stores the first choice value into the candidate order array
 
-        for(int i = 1; i < tally->candidate_count; i++) {       // Iterate (starting at 1) through the voter's choices and scan them in
-            if(fscanf(file, "%d", &vote->candidate_order[i]) == EOF) {      
-                break;
-            }
+        int keep = tally_screen_vote_r(ctx, tally, vote, reason, fname, line);
+        if(keep < 0) {      // Policy is to reject the whole file
+            ctx->dealloc(vote);
+            return -1;
+        }
+        if(keep == 0) {
+            ctx->dealloc(vote);
+            continue;
         }
 
-        tally_add_vote(tally, vote);        // Adds the vote to the tally
+        tally_add_vote_r(ctx, tally, vote);     // Adds the vote to the tally
 
         if(success == 1) {      // Logs the vote that was scanned in and prints the order data
-            printf("LOG: File '%s' vote ", fname);
-            vote_print(vote);
-            printf("\n");
+            fprintf(ctx->out, "LOG: File '%s' vote ", fname);
+            vote_print_r(ctx, vote);
+            fprintf(ctx->out, "\n");
         }
     }
-    if(success == 1) {      // Logs that the end of the file was reached
-        printf("LOG: File '%s' end of file reached\n", fname);
+    return curr_id - first_id;
+}
+// Reads votes from the current position of `file` until its end,
+// numbering them from `first_id` and adding each to the tally which
+// must already have its candidates set up. Used by tally_from_file_r()
+// after the header is read and to ingest votes appended to a file
+// later. Each vote is validated as it is decoded and one failing is
+// handled by the ctx->validate policy, keeping its id so later ids
+// still give positions in the file. Logs each vote added as described
+// below. Returns the number of votes read, or prints an error and
+// returns -1 if the policy rejects the file or its candidate count is
+// impossible.
+
+int vote_check_ranking(int value, int candidate_count, uint64_t *seen){
+    if(value == NO_CANDIDATE) {
+        return BALLOT_OK;
+    }
+    if(value < 0 || value >= candidate_count) {
+        return BALLOT_RANGE;
+    }
+    uint64_t bit = (uint64_t) 1 << (value & 63);
+    if(seen[value >> 6] & bit) {
+        return BALLOT_DUPLICATE;
     }
+    seen[value >> 6] |= bit;
+    return BALLOT_OK;
+}
+// Check one decoded ranking of a ballot against the candidate count
+// and the bitset `seen` of candidates already ranked on it, which holds
+// MAX_CANDIDATES bits zeroed at the start of each ballot, recording the
+// candidate. NO_CANDIDATE may appear any number of times. Returns a
+// BALLOT_* reason.
 
-    fclose(file);       // Close the file
-    return tally;
+static int vote_decode(FILE *file, int ch, int *value, int *end){
+    int negative = ch == '-';
+    if(ch == '-' || ch == '+') {
+        ch = getc_unlocked(file);
+    }
+    long number = 0;
+    int digits = 0;
+    while(ch >= '0' && ch <= '9') {
+        if(number <= INT_MAX) {     // larger values saturate, out of range anyway
+            number = number * 10 + (ch - '0');
+        }
+        digits++;
+        ch = getc_unlocked(file);
+    }
+    int kind = digits > 0;
+    if(kind && ch == ':') {     // a weight prefix such as 250:
+        ch = getc_unlocked(file);
+        kind = 2;
+    }
+    while(ch != EOF && !vote_space(ch)) {
+        kind = 0;           // trailing junk makes the whole token stray
+        ch = getc_unlocked(file);
+    }
+    if(number > INT_MAX) {
+        number = INT_MAX;
+    }
+    *value = negative ? -number : number;
+    *end = ch;
+    return kind;
+}
+// Decode the token of `file` starting with the non-space character
+// `ch` as an integer in the same pass as it is read. Returns 1 for an
+// integer, stored in `value`, 2 for an integer followed by a colon,
+// the weight of a pre-aggregated ballot, or 0 for any other token,
+// which is consumed whole so reading can carry on after it. The
+// whitespace or EOF ending the token is consumed and stored in `end`.
+
+static int vote_set_weight(vote_t *vote, int value){
+    vote->weight = value > 0 ? value : 1;
+    return value > 0 ? BALLOT_OK : BALLOT_WEIGHT;
+}
+// Give `vote` the weight read from its prefix, checking it.
+
+static int vote_read_stream(rcv_ctx_t *ctx, tally_t *tally, FILE *file, vote_t *vote, long *line){
+    int n = tally->candidate_count;
+    uint64_t seen[MAX_CANDIDATES / 64] = {0};
+    int reason = BALLOT_OK;
+    int weighted = 0;               // a weight prefix has been read
+    for(int i = 0; i < n; i++) {
+        int ch = getc_unlocked(file);
+        while(vote_space(ch)) {
+            ctx->stats.lines += ch == '\n';
+            ch = getc_unlocked(file);
+        }
+        if(ch == EOF) {
+            if(i == 0 && !weighted) {
+                return EOF;
+            }
+            return reason != BALLOT_OK ? reason : BALLOT_SHORT;
+        }
+        if(i == 0 && !weighted) {
+            *line = ctx->stats.lines + 1;
+        }
+        int value;
+        int kind = vote_decode(file, ch, &value, &ch);
+        ctx->stats.lines += ch == '\n';
+        if(kind == 2 && i == 0 && !weighted) {
+            weighted = 1;
+            reason = vote_set_weight(vote, value);
+            i--;                    // the first ranking is still to come
+            continue;
+        }
+        if(kind != 1) {
+            reason = reason != BALLOT_OK ? reason : BALLOT_STRAY;
+            continue;
+        }
+        vote->candidate_order[i] = value;
+        int check = vote_check_ranking(value, n, seen);
+        if(reason == BALLOT_OK) {
+            reason = check;
+        }
+    }
+    return reason;
+}
+// Read the next candidate_count rankings wherever the line breaks
+// fall, the original vote file format.
+
+static int vote_read_line(rcv_ctx_t *ctx, tally_t *tally, FILE *file, vote_t *vote, long *line){
+    int n = tally->candidate_count;
+    uint64_t seen[MAX_CANDIDATES / 64] = {0};
+    int reason = BALLOT_OK;
+    int count = 0;                  // rankings stored
+    int started = 0;                // a token of this ballot has been read
+    int weighted = 0;               // a weight prefix has been read
+    int ch = getc_unlocked(file);
+    while(1) {
+        while(ch != '\n' && vote_space(ch)) {
+            ch = getc_unlocked(file);
+        }
+        if(ch == '\n' || ch == EOF) {
+            if(started) {
+                ctx->stats.lines += ch == '\n';
+                return reason;
+            }
+            if(ch == EOF) {
+                return EOF;
+            }
+            ctx->stats.lines++;     // blank line, or the end of the header's
+            ch = getc_unlocked(file);
+            continue;
+        }
+        if(!started) {
+            started = 1;
+            *line = ctx->stats.lines + 1;
+        }
+        int value;
+        int kind = vote_decode(file, ch, &value, &ch);
+        if(kind == 2 && count == 0 && !weighted) {
+            weighted = 1;
+            int check = vote_set_weight(vote, value);
+            reason = reason != BALLOT_OK ? reason : check;
+            continue;
+        }
+        int check = kind != 1 ? BALLOT_STRAY : count == n ? BALLOT_LONG : BALLOT_OK;
+        if(check == BALLOT_OK) {
+            vote->candidate_order[count++] = value;
+            check = vote_check_ranking(value, n, seen);
+        }
+        if(reason == BALLOT_OK) {
+            reason = check;
+        }
+    }
+}
+// Read the next non-blank line as one ballot of up to candidate_count
+// rankings, the rest NO_CANDIDATE. A bad token only spoils its own
+// line since the next ballot always starts on the next line.
+
+int tally_read_vote_r(rcv_ctx_t *ctx, tally_t *tally, FILE *file, vote_t *vote, long *line){
+    if(ctx->line_mode) {
+        return vote_read_line(ctx, tally, file, vote, line);
+    }
+    return vote_read_stream(ctx, tally, file, vote, line);
+}
+// Read the next ballot of `file` into the candidate_order[] of `vote`
+// which starts out empty as from vote_make_empty_r(). By default a
+// ballot is the next candidate_count rankings wherever the line breaks
+// fall; with ctx->line_mode it is one line of any number of rankings
+// up to candidate_count. Either may start with a weight prefix such as
+// "250:" making the vote stand for that many identical ballots, as in a
+// pre-aggregated file; otherwise the weight stays as it was made, 1.
+// Each token is decoded and range and duplicate checked as it is read,
+// so validation costs no extra pass. Lines are
+// counted in ctx->stats.lines and the line the ballot starts on is
+// stored in `line`. Returns EOF if the file has no more ballots,
+// otherwise the first BALLOT_* reason the ballot fails for, or
+// BALLOT_OK.
+
+int tally_screen_vote_r(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote, int reason, char *fname, long line){
+    if(reason == BALLOT_OK) {
+        return 1;
+    }
+    ctx->stats.bad_ballots[reason]++;
+    char where[64] = "";
+    if(line > 0) {
+        snprintf(where, sizeof(where), " line %ld", line);
+    }
+    if(ctx->validate == RCV_VALIDATE_REJECT) {
+        fprintf(ctx->out, "ERROR: '%s'%s ballot #%04d: %s\n", fname, where, vote->id, bad_ballot_names[reason]);
+        return -1;
+    }
+    if(ctx->line_mode) {
+        fprintf(ctx->out, "WARNING: '%s'%s ballot #%04d: %s\n", fname, where, vote->id, bad_ballot_names[reason]);
+    }
+    if(ctx->validate == RCV_VALIDATE_SKIP) {
+        return 0;
+    }
+    for(int i = 0; i < tally->candidate_count; i++) {
+        vote->candidate_order[i] = NO_CANDIDATE;
+    }
+    return 1;
+}
+// Apply the ctx->validate policy to `vote`, numbered already, which
+// failed validation for `reason` on `line` of the file, 0 if unknown,
+// counting it in ctx->stats. Returns 1 if the vote should be added to
+// the tally, which for the invalid policy has had its rankings cleared
+// so that it is an invalid vote and can never index past the
+// candidates, 0 if it should be dropped, or -1 after printing an error
+// if the file should be rejected. In line mode every bad ballot is
+// also reported with a warning giving its line.
+
+long tally_ballots_read(rcv_ctx_t *ctx){
+    long count = ctx->stats.votes_added;
+    for(int r = 1; ctx->validate == RCV_VALIDATE_SKIP && r < BALLOT_REASONS; r++) {
+        count += ctx->stats.bad_ballots[r];
+    }
+    return count;
+}
+// Number of ballots read into `ctx` so far, which is the last id given
+// out: the votes added plus any bad ballots skipped.
+
+void tally_print_bad_ballots_r(rcv_ctx_t *ctx){
+    long total = 0;
+    for(int r = 1; r < BALLOT_REASONS; r++) {
+        total += ctx->stats.bad_ballots[r];
+    }
+    char *action = ctx->validate == RCV_VALIDATE_REJECT ? "file rejected" :
+                   ctx->validate == RCV_VALIDATE_SKIP ? "skipped" : "counted as invalid";
+    fprintf(ctx->out, "Bad ballots: %ld", total);
+    if(total > 0) {
+        fprintf(ctx->out, " (%s)", action);
+    }
+    fprintf(ctx->out, "\n");
+    for(int r = 1; r < BALLOT_REASONS; r++) {
+        int possible = ctx->line_mode ? r != BALLOT_SHORT : r != BALLOT_LONG;
+        if(possible || ctx->stats.bad_ballots[r] > 0) {
+            fprintf(ctx->out, "  %-20s %ld\n", bad_ballot_names[r], ctx->stats.bad_ballots[r]);
+        }
+    }
+}
+// Print how many ballots read into `ctx` failed validation, by reason,
+// and what the policy did with them, leaving out the reason that can't
+// occur in the parse mode used.
+
+tally_t *tally_from_file(char *fname){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    return tally_from_file_r(&ctx, fname);
 }
 // PROBLEM 3: Opens the given `fname` and reads its contents to create
 // a tally with votes assigned to candidates.  The format of the input
@@ -680,14 +1213,20 @@ tally_t *tally_from_file(char *fname){
 // "ERROR: couldn't open file 'XX'"
 // with XX as the filename. NULL is returned in this case.
 //
-// Aside from failure to open a file, this function assumes that the
-// data is formatted correctly and does no other error handling.
+// The data is expected to follow these conventions:
 // - The first token is NCAND, the number of candidates
 // - The next tokens are NCAND strings which are the candidate names
 // - Each subsequent vote has exactly NCAND integers
-// Bad input data that does not follow the above conventions will
-// cause this function to have unpredictable behavior that is not
-// tested.
+// A candidate count outside 1 to MAX_CANDIDATES prints
+// "ERROR: 'XX' has an invalid candidate count CC"
+// and NULL is returned. Each vote is validated as it is read: a
+// ranking that is not a candidate or NO_CANDIDATE, a candidate ranked
+// twice, a token that is not an integer or a last vote cut short is
+// handled by the context's validate policy, by default making the vote
+// invalid, and counted in ctx->stats.bad_ballots. Under the reject
+// policy the first bad vote prints
+// "ERROR: 'XX' ballot #0012: duplicate ranking"
+// and NULL is returned.
 //
 // LOGGING: If LOG_LEVEL >= LOG_FILEIO, this function prints the
 // following messages which show the progress of the
@@ -702,6 +1241,104 @@ tally_t *tally_from_file(char *fname){
 // MAKEUP CREDIT: Handles readin NO_CANDIDATE (-1) entries in the
 // candidate order. If the first preference in a vote is -1, it is
 // immediately placed in the Invalid Vote list
+//
+// A `fname` of "-" reads standard input. The file is opened with
+// rcv_input_open() so a background thread reads ahead while votes are
+// parsed, pipes and FIFOs work as well as regular files, and gzip
+// compressed files are decompressed on the fly. If reading or
+// decompressing fails part way, "ERROR: couldn't read file 'XX'" is
+// printed and NULL returned.
+
+////////////////////////////////////////////////////////////////////////////////
+// SNAPSHOTS
+
+tally_snapshot_t *tally_snapshot_r(rcv_ctx_t *ctx, tally_t *tally){
+    tally_snapshot_t *snap = ctx->alloc(sizeof(tally_snapshot_t));
+    snap->tally = tally;
+    memcpy(snap->candidate_status, tally->candidate_status, sizeof(snap->candidate_status));
+    memcpy(snap->candidate_vote_counts, tally->candidate_vote_counts, sizeof(snap->candidate_vote_counts));
+    snap->invalid_vote_count = tally->invalid_vote_count;
+
+    int n = tally->candidate_count;
+    int total = 0;
+    for(int c = 0; c <= n; c++) {               // list n is the invalid votes
+        vote_t *vote = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        for(; vote != NULL; vote = vote->next) {
+            total++;
+        }
+    }
+    snap->vote_count = total;
+    snap->votes = ctx->alloc(sizeof(vote_t *) * (total + 1));
+    snap->pos = ctx->alloc(sizeof(int) * (total + 1));
+
+    int k = 0;
+    for(int c = 0; c <= n; c++) {
+        snap->list_starts[c] = k;
+        vote_t *vote = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        for(; vote != NULL; vote = vote->next) {
+            snap->votes[k] = vote;
+            snap->pos[k] = vote->pos;
+            k++;
+        }
+    }
+    snap->list_starts[n + 1] = k;
+    return snap;
+}
+// Record the state of a tally which elections change: candidate
+// statuses and counts, the order of every vote list, and the pos of
+// every vote. Votes themselves are not copied as their
+// candidate_order[] never changes during an election. The snapshot
+// refers to the votes of `tally` so it must be freed before the tally.
+
+void tally_restore_r(rcv_ctx_t *ctx, tally_snapshot_t *snap){
+    tally_t *tally = snap->tally;
+    int n = tally->candidate_count;
+    memcpy(tally->candidate_status, snap->candidate_status, sizeof(snap->candidate_status));
+    memcpy(tally->candidate_vote_counts, snap->candidate_vote_counts, sizeof(snap->candidate_vote_counts));
+    tally->invalid_vote_count = snap->invalid_vote_count;
+    for(int c = 0; c <= n; c++) {
+        int start = snap->list_starts[c], end = snap->list_starts[c + 1];
+        for(int k = start; k < end; k++) {
+            snap->votes[k]->pos = snap->pos[k];
+            snap->votes[k]->next = k + 1 < end ? snap->votes[k + 1] : NULL;
+        }
+        vote_t *head = start < end ? snap->votes[start] : NULL;
+        if(c < n) {
+            tally->candidate_votes[c] = head;
+        }
+        else {
+            tally->invalid_votes = head;
+        }
+    }
+}
+// Return the tally a snapshot was taken of to exactly its state at
+// that time by relinking every list in its recorded order and resetting
+// each vote's pos. Runs in time proportional to the number of votes
+// with sequential passes over the snapshot arrays, so an election can
+// be re-run from a loaded tally many times without re-reading its
+// file. A snapshot may be restored any number of times.
+
+void tally_snapshot_free_r(rcv_ctx_t *ctx, tally_snapshot_t *snap){
+    ctx->dealloc(snap->votes);
+    ctx->dealloc(snap->pos);
+    ctx->dealloc(snap);
+}
+// De-allocate a snapshot; the tally and its votes are not affected.
+
+tally_snapshot_t *tally_snapshot(tally_t *tally){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    return tally_snapshot_r(&ctx, tally);
+}
+
+void tally_restore(tally_snapshot_t *snap){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_restore_r(&ctx, snap);
+}
+
+void tally_snapshot_free(tally_snapshot_t *snap){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    tally_snapshot_free_r(&ctx, snap);
+}
 
 int main(int argc, char *argv[]);
 
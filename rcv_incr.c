@@ -0,0 +1,288 @@
+// rcv_incr.c: Incremental re-tabulation of a vote file that has late
+// ballots appended to it. The parsed votes and a history of every
+// round are kept between updates so that only new ballots are parsed
+// and rounds are re-run only from the first one whose outcome changes.
+
+#include "rcv.h"
+#include <sys/stat.h>
+
+static char *incr_read_complete(rcv_incr_t *incr, long *len){
+    *len = 0;
+    FILE *file = fopen(incr->fname, "r");
+    if(file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    char *buf = NULL;
+    if(size > incr->offset) {
+        buf = malloc(size - incr->offset);
+        fseek(file, incr->offset, SEEK_SET);
+        long got = fread(buf, 1, size - incr->offset, file);
+        while(got > 0 && buf[got - 1] != '\n') {    // leave any partly written line for later
+            got--;
+        }
+        *len = got;
+    }
+    fclose(file);
+    return buf;
+}
+// Read the bytes appended to the vote file since the last update up to
+// and including the last newline so that a ballot still being written
+// is not parsed. Returns a malloc()'d buffer with its length in `len`
+// or NULL, with `len` 0, if the file can't be opened.
+
+static int incr_first_live(vote_t *vote, char *dropped, int candidate_count){
+    for(int i = 0; i < candidate_count && vote->candidate_order[i] != NO_CANDIDATE; i++) {
+        if(!dropped[vote->candidate_order[i]]) {
+            return i;
+        }
+    }
+    return -1;
+}
+// Return the position in the vote's candidate order of the first
+// candidate not flagged in `dropped` or -1 if every ranked candidate
+// is dropped. This is where vote_next_candidate() leaves a vote once
+// those candidates have been dropped.
+
+static void incr_place(tally_t *tally, vote_t *vote, char *dropped){
+    int pos = incr_first_live(vote, dropped, tally->candidate_count);
+    if(pos < 0) {
+        vote->pos = tally->candidate_count;
+        vote->next = tally->invalid_votes;
+        tally->invalid_votes = vote;
+        tally->invalid_vote_count += vote->weight;
+        return;
+    }
+    vote->pos = pos;
+    int cand = vote->candidate_order[pos];
+    vote->next = tally->candidate_votes[cand];
+    tally->candidate_votes[cand] = vote;
+    tally->candidate_vote_counts[cand] += vote->weight;
+}
+// Prepend the vote to the list of the candidate it is with given the
+// `dropped` flags, or to the invalid votes if it has none left.
+
+static void incr_record(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    rcv_incr_t *incr = arg;
+    int n = tally->candidate_count;
+    for(int i = 0; i < n; i++) {
+        incr->round_counts[round][i] = tally->candidate_vote_counts[i];
+        incr->round_marks[round][i] = tally->candidate_status[i] == CAND_MINVOTES;
+        incr->round_dropped[round][i] = incr->round_dropped[round - 1][i] || incr->round_marks[round - 1][i];
+    }
+    incr->round_invalid[round] = tally->invalid_vote_count;
+    incr->rounds = round;
+}
+// Round hook recording the counts and invalid votes at the end of each round, which
+// candidates were dropped before those counts were taken and which are
+// marked MINVOTES to be dropped in the next round. Row 0 holds the
+// initial state with no counts or marks.
+
+static int incr_marks_match(rcv_incr_t *incr, int round, int n){
+    int min = INT_MAX;
+    for(int i = 0; i < n; i++) {
+        if(!incr->round_dropped[round][i] && incr->round_counts[round][i] < min) {
+            min = incr->round_counts[round][i];
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        if((incr->round_counts[round][i] == min) != incr->round_marks[round][i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+// Check whether the MINVOTES candidates recorded for `round` are still
+// exactly those tally_set_minvote_candidates() would choose from the
+// updated counts of that round.
+
+static void incr_run(rcv_ctx_t *ctx, rcv_incr_t *incr, int round){
+    rcv_ctx_t run = *ctx;
+    rcv_ctx_add_round_hook(&run, incr_record, incr);
+    if(round > 0) {
+        for(int i = 0; i < run.round_hook_count; i++) {
+            run.round_hooks[i](&run, incr->tally, round, run.round_hook_args[i]);
+        }
+    }
+    incr->rounds = round;
+    incr->condition = tally_election_resume_r(&run, incr->tally, round);
+    ctx->stats = run.stats;
+}
+// Run the election from the end of `round` with the history recording
+// hook installed, first re-running the hooks for `round` itself whose
+// MINVOTES candidates were just re-determined.
+
+rcv_incr_t *rcv_incr_open_r(rcv_ctx_t *ctx, char *fname){
+    rcv_incr_t *incr = calloc(1, sizeof(rcv_incr_t));
+    snprintf(incr->fname, sizeof(incr->fname), "%s", fname);
+    long len;
+    char *buf = incr_read_complete(incr, &len);
+    if(len == 0) {                              // missing or no complete line yet
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        free(buf);
+        free(incr);
+        return NULL;
+    }
+    FILE *stream = fmemopen(buf, len, "r");
+    incr->tally = tally_from_stream_r(ctx, stream, fname);
+    fclose(stream);
+    free(buf);
+    if(incr->tally == NULL) {                   // rejected by the validation policy
+        free(incr);
+        return NULL;
+    }
+    incr->offset = len;
+    incr->vote_count = tally_ballots_read(ctx);
+
+    int rows = MAX_CANDIDATES + 1;                // every round drops at least one candidate
+    incr->round_counts  = calloc(rows, sizeof(*incr->round_counts));
+    incr->round_dropped = calloc(rows, sizeof(*incr->round_dropped));
+    incr->round_marks   = calloc(rows, sizeof(*incr->round_marks));
+    incr->round_invalid = calloc(rows, sizeof(*incr->round_invalid));
+    for(int i = 0; i < incr->tally->candidate_count; i++) {
+        incr->round_dropped[0][i] = incr->tally->candidate_status[i] == CAND_DROPPED;
+    }
+    incr->replay_round = 1;
+    incr_run(ctx, incr, 0);
+    return incr;
+}
+// Load the complete ballots currently in `fname` and run the election
+// on them with output to ctx->out exactly as tally_election_r() while
+// recording the history of rounds for later updates. Prints an error
+// and returns NULL if the file can't be opened, has no complete line
+// yet or is rejected by the ctx->validate policy.
+
+int rcv_incr_update_r(rcv_ctx_t *ctx, rcv_incr_t *incr){
+    long len;
+    char *buf = incr_read_complete(incr, &len);
+    if(len == 0) {
+        free(buf);
+        return 0;
+    }
+    tally_t *tally = incr->tally;
+    int n = tally->candidate_count;
+    int rounds = incr->rounds;
+
+    // Parse the new ballots into a scratch tally sharing the candidates,
+    // then move each into the history and the live tally.
+    tally_t *fresh = calloc(1, sizeof(tally_t));
+    fresh->candidate_count = n;
+    for(int i = 0; i < n; i++) {
+        fresh->candidate_status[i] = CAND_ACTIVE;
+    }
+    FILE *stream = fmemopen(buf, len, "r");
+    int added = tally_read_votes_r(ctx, fresh, stream, incr->fname, incr->vote_count + 1);
+    fclose(stream);
+    free(buf);
+    if(added < 0) {                             // rejected: left unread for a later update
+        tally_free_r(ctx, fresh);
+        return -1;
+    }
+    incr->offset += len;
+    incr->vote_count += added;
+
+    char *final_dropped = incr->round_dropped[rounds];
+    for(int c = 0; c <= n; c++) {
+        vote_t *vote = c < n ? fresh->candidate_votes[c] : fresh->invalid_votes;
+        while(vote != NULL) {
+            vote_t *next = vote->next;
+            for(int r = 1; r <= rounds; r++) {
+                int pos = incr_first_live(vote, incr->round_dropped[r], n);
+                if(pos >= 0) {
+                    incr->round_counts[r][vote->candidate_order[pos]] += vote->weight;
+                }
+                else {
+                    incr->round_invalid[r] += vote->weight;
+                }
+            }
+            incr_place(tally, vote, final_dropped);
+            vote = next;
+        }
+    }
+    free(fresh);
+
+    int replay = 0;                             // first round whose MINVOTES changed
+    for(int r = 1; r <= rounds && replay == 0; r++) {
+        if(!incr_marks_match(incr, r, n)) {
+            replay = r;
+        }
+    }
+    int reused = replay == 0 ? rounds : replay;
+    fprintf(ctx->out, "=== UPDATE: %d new votes, %d total ===\n", added, incr->vote_count);
+
+    // Tables of rounds whose counts are known from the history
+    tally_t *shown = malloc(sizeof(tally_t));
+    memcpy(shown, tally, sizeof(tally_t));
+    for(int r = 1; r <= reused; r++) {
+        for(int i = 0; i < n; i++) {
+            shown->candidate_status[i] = incr->round_dropped[r][i] ? CAND_DROPPED : CAND_ACTIVE;
+            shown->candidate_vote_counts[i] = incr->round_counts[r][i];
+        }
+        shown->invalid_vote_count = incr->round_invalid[r];
+        fprintf(ctx->out, "=== ROUND %d ===\n", r);
+        tally_print_table_r(ctx, shown);
+    }
+    free(shown);
+
+    if(replay == 0) {                           // elimination order unchanged
+        incr->replay_round = 0;
+        incr->condition = tally_election_resume_r(ctx, tally, rounds);
+        return added;
+    }
+
+    // Rebuild the tally as it stood at the end of round `replay` with
+    // every vote relinked in id order, then redo that round's MINVOTES
+    // and continue the election from there.
+    vote_t **by_id = calloc(incr->vote_count, sizeof(vote_t *));
+    for(int c = 0; c <= n; c++) {
+        vote_t *vote = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        while(vote != NULL) {
+            by_id[vote->id - 1] = vote;
+            vote = vote->next;
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        tally->candidate_votes[i] = NULL;
+        tally->candidate_vote_counts[i] = 0;
+        tally->candidate_status[i] = incr->round_dropped[replay][i] ? CAND_DROPPED : CAND_ACTIVE;
+    }
+    tally->invalid_votes = NULL;
+    tally->invalid_vote_count = 0;
+    for(int v = 0; v < incr->vote_count; v++) {
+        if(by_id[v] != NULL) {
+            incr_place(tally, by_id[v], incr->round_dropped[replay]);
+        }
+    }
+    free(by_id);
+    tally_set_minvote_candidates_r(ctx, tally);
+    incr->replay_round = replay + 1;
+    incr_run(ctx, incr, replay);
+    return added;
+}
+// Ingest ballots appended to the vote file since the last update and
+// print updated results to ctx->out. Each new ballot is parsed once
+// and its contribution to every recorded round is added by finding
+// its first candidate not yet dropped in that round; no existing
+// ballot is touched. If every round still marks the same MINVOTES
+// candidates, the elimination order is unchanged and the updated
+// tables are printed straight from the history, taking time
+// proportional to the new ballots. Otherwise the rounds up to the
+// first changed one are printed from the history and the election is
+// re-run from the end of that round. Round tables and results match a
+// full re-run; log messages are only produced for re-run rounds. The
+// output starts with the line
+// "=== UPDATE: NN new votes, TT total ==="
+// Returns the number of ballots added, 0 if nothing complete was
+// appended in which case nothing is printed, or -1 after printing an
+// error if the new ballots are rejected by the ctx->validate policy.
+
+void rcv_incr_free_r(rcv_ctx_t *ctx, rcv_incr_t *incr){
+    tally_free_r(ctx, incr->tally);
+    free(incr->round_counts);
+    free(incr->round_dropped);
+    free(incr->round_marks);
+    free(incr->round_invalid);
+    free(incr);
+}
+// De-allocate the incremental state including all of its votes.
@@ -0,0 +1,251 @@
+// rcv_index.c: Sidecar index of a vote file giving the byte offset of
+// every ballot, so a single ballot can be fetched by its id without
+// parsing the file up to it.
+//
+// Ballot ids are positions: tally_read_votes_r() numbers votes from 1
+// in file order, and a vote is an optional weight prefix then the next
+// candidate_count integers wherever the line breaks fall. The index of
+// FILE is FILE.idx, in the byte order of the machine that wrote it:
+//
+//   8 bytes RCV_INDEX_MAGIC
+//   int64 size, mtime_sec, mtime_nsec    of FILE when indexed
+//   int32 candidate_count, ballot_count
+//   int64 offsets[ballot_count]          of each ballot's first token
+//
+// Compressed vote files can't be indexed since they can't be read from
+// an offset.
+
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define RCV_INDEX_MAGIC "RCVIDX1\n"
+#define INDEX_READ_SIZE (1 << 20)
+
+typedef struct {                // Fixed part of an index file
+  char magic[8];
+  int64_t size, mtime_sec, mtime_nsec;
+  int32_t candidate_count, ballot_count;
+} rcv_index_head_t;
+
+static int index_space(char ch){
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+static void index_path(char *dest, size_t size, char *fname){
+    snprintf(dest, size, "%s.idx", fname);
+}
+
+typedef struct {                // Tokenizer state while building an index
+  long tokens;                  // tokens seen so far
+  int n;                        // candidates, from the first token
+  char first[32];
+  int first_len;
+  int shape;                    // 3 if the token is a weight prefix [+-]digits:, 4 once it can't be
+  int64_t start;                // where the current token starts
+  int rankings, weighted;       // of the ballot being read
+  int64_t *offsets;
+  long cap, count;
+} index_scan_t;
+
+static void index_token_end(index_scan_t *scan){
+    if(scan->tokens == 1) {                     // the candidate count
+        scan->first[scan->first_len] = '\0';
+        scan->n = atoi(scan->first);
+        return;
+    }
+    if(scan->n < 1 || scan->tokens <= 1 + scan->n) {
+        return;                                 // a name
+    }
+    if(scan->rankings == 0 && !scan->weighted) {    // a ballot starts with this token
+        if(scan->count == scan->cap) {
+            scan->cap *= 2;
+            scan->offsets = realloc(scan->offsets, sizeof(int64_t) * scan->cap);
+        }
+        scan->offsets[scan->count++] = scan->start;
+        if(scan->shape == 3) {
+            scan->weighted = 1;
+            return;
+        }
+    }
+    if(++scan->rankings == scan->n) {
+        scan->rankings = 0;
+        scan->weighted = 0;
+    }
+}
+// Account for the token that just ended as tally_read_vote_r() would in
+// its default mode: the candidate count, the names, then per ballot an
+// optional weight prefix and candidate_count rankings, recording where
+// each ballot's first token starts.
+
+int rcv_index_build_r(rcv_ctx_t *ctx, char *fname){
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    unsigned char magic[2];
+    if(pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        fprintf(ctx->out, "ERROR: '%s' is compressed and can't be indexed\n", fname);
+        close(fd);
+        return -1;
+    }
+
+    char *buf = malloc(INDEX_READ_SIZE);
+    index_scan_t scan = {.cap = 1024};
+    scan.offsets = malloc(sizeof(int64_t) * scan.cap);
+    int in_token = 0;
+    int64_t base = 0;
+    ssize_t got;
+    while((got = read(fd, buf, INDEX_READ_SIZE)) > 0 || (got < 0 && errno == EINTR)) {
+        for(ssize_t i = 0; i < got; i++) {
+            char ch = buf[i];
+            if(index_space(ch)) {
+                if(in_token) {
+                    index_token_end(&scan);
+                }
+                in_token = 0;
+                continue;
+            }
+            if(!in_token) {                     // a token starts here
+                in_token = 1;
+                scan.tokens++;
+                scan.start = base + i;
+                scan.shape = 0;
+            }
+            if(scan.tokens == 1 && scan.first_len < (int) sizeof(scan.first) - 1) {
+                scan.first[scan.first_len++] = ch;
+            }
+            scan.shape = scan.shape == 0 && (ch == '+' || ch == '-') ? 1 :
+                         scan.shape <= 2 && ch >= '0' && ch <= '9' ? 2 :
+                         scan.shape == 2 && ch == ':' ? 3 : 4;
+        }
+        base += got;
+    }
+    if(in_token) {                              // a last token with no space after it
+        index_token_end(&scan);
+    }
+    free(buf);
+    close(fd);
+    int n = scan.n;
+    long count = scan.count;
+    int64_t *offsets = scan.offsets;
+    if(got < 0 || n < 1 || n > MAX_CANDIDATES || count > INT_MAX) {
+        fprintf(ctx->out, "ERROR: couldn't index file '%s'\n", fname);
+        free(offsets);
+        return -1;
+    }
+
+    char path[PATH_MAX + 8], tmp[PATH_MAX + 16];
+    index_path(path, sizeof(path), fname);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    rcv_index_head_t head = {.size = st.st_size, .mtime_sec = st.st_mtim.tv_sec, .mtime_nsec = st.st_mtim.tv_nsec,
+                             .candidate_count = n, .ballot_count = count};
+    memcpy(head.magic, RCV_INDEX_MAGIC, 8);
+    FILE *file = fopen(tmp, "wb");
+    int ok = file != NULL &&
+             fwrite(&head, sizeof(head), 1, file) == 1 &&
+             fwrite(offsets, sizeof(int64_t), count, file) == (size_t) count;
+    if(file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+    free(offsets);
+    if(!ok || rename(tmp, path) != 0) {
+        fprintf(ctx->out, "ERROR: couldn't write index '%s'\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return count;
+}
+// Build the index FILE.idx of vote file `fname` in one pass over its
+// bytes, splitting it into whitespace separated tokens as
+// index_token_end() describes. A short last ballot is indexed like any
+// other. The index is
+// written to a temporary file and renamed into place. Returns the
+// number of ballots indexed, or prints an error and returns -1.
+
+static int index_read(int ifd, int fd, int id, vote_t *vote){
+    struct stat st;
+    rcv_index_head_t head;
+    if(fstat(fd, &st) != 0 ||
+       pread(ifd, &head, sizeof(head), 0) != sizeof(head) ||
+       memcmp(head.magic, RCV_INDEX_MAGIC, 8) != 0 || head.size != st.st_size ||
+       head.mtime_sec != st.st_mtim.tv_sec || head.mtime_nsec != st.st_mtim.tv_nsec ||
+       head.candidate_count < 1 || head.candidate_count > MAX_CANDIDATES) {
+        return -1;                              // stale or not an index
+    }
+    int64_t offset, end = st.st_size;           // the ballot ends where the next starts
+    if(id < 1 || id > head.ballot_count ||
+       pread(ifd, &offset, sizeof(offset), sizeof(head) + sizeof(int64_t) * (id - 1)) != sizeof(offset) ||
+       (id < head.ballot_count &&
+        pread(ifd, &end, sizeof(end), sizeof(head) + sizeof(int64_t) * id) != sizeof(end)) ||
+       offset < 0 || end < offset || end > st.st_size) {
+        return 0;
+    }
+    size_t len = end - offset;
+    char *text = malloc(len + 1);
+    if(pread(fd, text, len, offset) != (ssize_t) len) {
+        free(text);
+        return 0;
+    }
+    text[len] = '\0';
+    vote->id = id;
+    vote->pos = 0;
+    vote->next = NULL;
+    for(int i = 0; i < MAX_CANDIDATES; i++) {
+        vote->candidate_order[i] = NO_CANDIDATE;
+    }
+    vote->weight = 1;
+    char *p = text;
+    while(index_space(*p)) {
+        p++;
+    }
+    char *colon;
+    long weight = strtol(p, &colon, 10);
+    if(colon != p && *colon == ':' && (colon[1] == '\0' || index_space(colon[1]))) {
+        vote->weight = weight <= 0 ? 1 : weight > INT_MAX ? INT_MAX : weight;
+        p = colon + 1;
+    }
+    for(int i = 0; i < head.candidate_count; i++) {
+        while(index_space(*p)) {
+            p++;
+        }
+        if(*p == '\0') {
+            break;
+        }
+        vote->candidate_order[i] = atoi(p);
+        while(*p != '\0' && !index_space(*p)) {
+            p++;
+        }
+    }
+    free(text);
+    return 1;
+}
+// Read ballot `id` with two index reads and one read of the ballot's
+// own bytes.
+
+int rcv_index_lookup_r(rcv_ctx_t *ctx, char *fname, int id, vote_t *vote){
+    char path[PATH_MAX + 8];
+    index_path(path, sizeof(path), fname);
+    int ifd = open(path, O_RDONLY);
+    int fd = open(fname, O_RDONLY);
+    int result = ifd >= 0 && fd >= 0 ? index_read(ifd, fd, id, vote) : -1;
+    if(ifd >= 0) {
+        close(ifd);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+// Fetch ballot `id` of vote file `fname` through its index, reading
+// only the bytes of that ballot, into `vote`: its weight and rankings
+// as they appear in the file, unvalidated, the rest NO_CANDIDATE and
+// pos 0. Returns 1 on success, 0 if there is no ballot `id`, or -1 if
+// the index is missing or older than the file.
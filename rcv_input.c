@@ -0,0 +1,292 @@
+// rcv_input.c: Vote file input read ahead by background threads so
+// reading, decompression and parsing overlap, for regular files as
+// well as pipes, FIFOs and standard input, plain or gzip-compressed.
+//
+// Data flows through a pipeline of stages connected by channels of
+// two buffers each: a reader thread fills the raw channel with read(),
+// and for gzip input an inflater thread turns raw buffers into the
+// decoded channel. The parser reads the last channel through a stdio
+// FILE, taking names with vote_read_word() and rankings with
+// vote_decode(), which pull one character at a time with
+// getc_unlocked() straight from the current buffer.
+
+#define _GNU_SOURCE             // for fopencookie()
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define INPUT_BUF_SIZE (1 << 20)        // bytes per pipeline buffer
+
+typedef struct {                // Two buffers passed from one stage to the next
+  char *bufs[2];
+  ssize_t lens[2];              // bytes in each buffer, 0 marks the end, -1 an error
+  int full[2];                  // filled and not yet consumed
+  int put;                      // buffer the producer fills next
+  int get;                      // buffer the consumer reads next
+} input_chan_t;
+
+typedef struct {                // Input stream state behind the FILE
+  int fd;
+  int own_fd;                   // close fd at the end, not done for stdin
+  input_chan_t raw;             // file contents from the reader
+  input_chan_t decoded;         // decompressed contents from the inflater
+  input_chan_t *out;            // channel the parser reads, NULL until the format is known
+  ssize_t off;                  // parser's position in out's current buffer
+  int inflating;                // set once the inflater thread is started
+  int stop;                     // set when the stream is closed
+  pthread_mutex_t lock;         // guards the channels' full[] and lens[] and stop
+  pthread_cond_t cond;          // signalled whenever any of them change
+  pthread_t reader;
+  pthread_t inflater;
+} input_t;
+
+static char *chan_fill(input_t *in, input_chan_t *ch){
+    pthread_mutex_lock(&in->lock);
+    while(ch->full[ch->put] && !in->stop) {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    int stop = in->stop;
+    pthread_mutex_unlock(&in->lock);
+    return stop ? NULL : ch->bufs[ch->put];
+}
+// Producer side: wait for the next buffer to be free and return it, or
+// NULL if the stream is being closed.
+
+static void chan_filled(input_t *in, input_chan_t *ch, ssize_t len){
+    pthread_mutex_lock(&in->lock);
+    ch->lens[ch->put] = len;
+    ch->full[ch->put] = 1;
+    ch->put ^= 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+// Producer side: hand the buffer from chan_fill() to the consumer.
+
+static ssize_t chan_next(input_t *in, input_chan_t *ch, char **data){
+    pthread_mutex_lock(&in->lock);
+    while(!ch->full[ch->get] && !in->stop) {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    ssize_t len = ch->full[ch->get] ? ch->lens[ch->get] : 0;
+    pthread_mutex_unlock(&in->lock);
+    *data = ch->bufs[ch->get];
+    return len;
+}
+// Consumer side: wait for the next buffer and return its length,
+// setting `data` to its contents. The buffer stays the consumer's until
+// chan_release(). Returns 0 at the end and -1 after an error.
+
+static void chan_release(input_t *in, input_chan_t *ch){
+    pthread_mutex_lock(&in->lock);
+    ch->full[ch->get] = 0;
+    ch->get ^= 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+// Consumer side: give the buffer from chan_next() back to the producer.
+
+static void *input_reader(void *arg){
+    input_t *in = arg;
+    ssize_t got = 1;
+    while(got > 0) {
+        char *buf = chan_fill(in, &in->raw);
+        if(buf == NULL) {
+            break;
+        }
+        do {
+            got = read(in->fd, buf, INPUT_BUF_SIZE);
+        } while(got < 0 && errno == EINTR);
+        chan_filled(in, &in->raw, got < 0 ? -1 : got);
+    }
+    return NULL;
+}
+// Reader stage: fill raw buffers in turn with one read() each, which
+// for a pipe returns what has arrived so far rather than waiting for a
+// full buffer, ending with an empty buffer or -1 if read() failed.
+
+static void *input_inflater(void *arg){
+    input_t *in = arg;
+    z_stream zs = {0};
+    inflateInit2(&zs, 15 + 32);                 // 32: accept a gzip or zlib header
+    char *out = chan_fill(in, &in->decoded);
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = INPUT_BUF_SIZE;
+    ssize_t status = 0;                         // final length: 0 at the end, -1 on error
+    int ended = 0;                              // the last member was complete
+    while(out != NULL) {
+        char *data;
+        ssize_t len = chan_next(in, &in->raw, &data);
+        if(len <= 0) {
+            status = len < 0 || !ended ? -1 : 0;    // truncated input is an error
+            chan_release(in, &in->raw);
+            break;
+        }
+        zs.next_in = (Bytef *) data;
+        zs.avail_in = len;
+        while(status == 0) {
+            if(ended) {
+                if(zs.avail_in == 0) {
+                    break;
+                }
+                inflateReset(&zs);              // another gzip member follows
+                ended = 0;
+            }
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if(ret == Z_STREAM_END) {
+                ended = 1;
+            }
+            else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+                status = -1;
+            }
+            if(zs.avail_out == 0) {             // output buffer full, pass it on
+                chan_filled(in, &in->decoded, INPUT_BUF_SIZE);
+                out = chan_fill(in, &in->decoded);
+                if(out == NULL) {
+                    break;
+                }
+                zs.next_out = (Bytef *) out;
+                zs.avail_out = INPUT_BUF_SIZE;
+            }
+            else if(!ended) {                   // all input used, need more
+                break;
+            }
+        }
+        chan_release(in, &in->raw);
+        if(status != 0) {
+            break;
+        }
+    }
+    if(out != NULL) {
+        ssize_t pending = INPUT_BUF_SIZE - zs.avail_out;
+        if(pending > 0) {
+            chan_filled(in, &in->decoded, pending);
+            out = chan_fill(in, &in->decoded);
+        }
+        if(out != NULL) {
+            chan_filled(in, &in->decoded, status);
+        }
+    }
+    inflateEnd(&zs);
+    return NULL;
+}
+// Inflater stage: decompress raw buffers into decoded buffers, passing
+// each on when full, then a final partial buffer and an end marker.
+// Consecutive gzip members, as produced by concatenating .gz files,
+// are decoded one after another. Corrupt or truncated input ends the
+// stream with an error.
+
+static void input_start(input_t *in){
+    char *data;
+    ssize_t len = chan_next(in, &in->raw, &data);
+    if(len >= 2 && (unsigned char) data[0] == 0x1f && (unsigned char) data[1] == 0x8b) {
+        in->decoded.bufs[0] = malloc(INPUT_BUF_SIZE);
+        in->decoded.bufs[1] = malloc(INPUT_BUF_SIZE);
+        pthread_create(&in->inflater, NULL, input_inflater, in);
+        in->inflating = 1;
+        in->out = &in->decoded;
+    }
+    else {
+        in->out = &in->raw;
+    }
+}
+// On the first read decide from the gzip magic bytes at the start of
+// the input whether the parser reads the raw data or starts an
+// inflater stage and reads its output.
+
+static ssize_t input_read(void *cookie, char *dest, size_t size){
+    input_t *in = cookie;
+    if(in->out == NULL) {
+        input_start(in);
+    }
+    char *data;
+    ssize_t len = chan_next(in, in->out, &data);
+    if(len > 0 && in->off == len) {             // used up, move to the next buffer
+        chan_release(in, in->out);
+        in->off = 0;
+        len = chan_next(in, in->out, &data);
+    }
+    if(len <= 0) {
+        if(len < 0) {
+            errno = EIO;
+        }
+        return len;
+    }
+    ssize_t n = len - in->off;
+    if(n > (ssize_t) size) {
+        n = size;
+    }
+    memcpy(dest, data + in->off, n);
+    in->off += n;
+    return n;
+}
+// Cookie read function for the FILE: copy from the parser's current
+// buffer, switching to the next once it is used up. Returns 0 at the
+// end of input and -1 with errno EIO if reading or decompressing
+// failed, which sets the FILE's error indicator.
+
+static int input_close(void *cookie){
+    input_t *in = cookie;
+    pthread_mutex_lock(&in->lock);
+    in->stop = 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->reader, NULL);
+    if(in->inflating) {
+        pthread_join(in->inflater, NULL);
+    }
+    if(in->own_fd) {
+        close(in->fd);
+    }
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->cond);
+    for(int i = 0; i < 2; i++) {
+        free(in->raw.bufs[i]);
+        free(in->decoded.bufs[i]);
+    }
+    free(in);
+    return 0;
+}
+// Cookie close function: stop the pipeline threads and free everything.
+
+FILE *rcv_input_open(char *fname){
+    int is_stdin = strcmp(fname, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    input_t *in = calloc(1, sizeof(input_t));
+    in->fd = fd;
+    in->own_fd = !is_stdin;
+    in->raw.bufs[0] = malloc(INPUT_BUF_SIZE);
+    in->raw.bufs[1] = malloc(INPUT_BUF_SIZE);
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    cookie_io_functions_t io = {.read = input_read, .close = input_close};
+    FILE *file = fopencookie(in, "r", io);
+    if(file == NULL) {
+        if(in->own_fd) {
+            close(fd);
+        }
+        free(in->raw.bufs[0]);
+        free(in->raw.bufs[1]);
+        free(in);
+        return NULL;
+    }
+    pthread_create(&in->reader, NULL, input_reader, in);
+    return file;
+}
+// Open vote file `fname` for reading, or standard input if it is "-",
+// returning a FILE to be read with the usual stdio functions and closed
+// with fclose(). A background thread reads the input into alternating
+// INPUT_BUF_SIZE buffers, so the next block is being read while the
+// caller parses the current one. Input starting with the gzip magic
+// bytes is decompressed with zlib by a second thread between the
+// reader and the caller, so reading, decompression and parsing run on
+// different cores. Works the same on pipes and FIFOs, which can't be
+// seeked or re-read. Read errors and corrupt or truncated compressed
+// data set the FILE's error indicator, see ferror(). Returns NULL with
+// errno set if the file can't be opened. fclose() waits for a pending
+// read() to return, so a stream should normally be read to its end.
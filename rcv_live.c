@@ -0,0 +1,364 @@
+// rcv_live.c: Live tabulation of a vote stream while ballots are still
+// arriving. The main thread parses ballots as they land, with the same
+// reader and validation as a vote file, and adds them to a tally with
+// tally_add_vote_r(), so first choice counts are always current, while
+// a background thread re-runs the full election at a fixed interval
+// over a consistent copy of the ballots seen so far and publishes the
+// result.
+
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define LIVE_READ_SIZE (1 << 16)        // bytes per read()
+#define LIVE_FOLLOW_MS 50               // wait before checking a followed file again
+
+struct rcv_live {               // Live tabulation, see rcv_live_open_r()
+  rcv_ctx_t *ctx;
+  char fname[PATH_MAX];
+  int fd;
+  int own_fd;                   // close fd at the end, not done for stdin
+  int follow;                   // keep reading a regular file past its end
+  int interval_ms;
+  char *data;                   // bytes read but not parsed yet
+  long data_len, data_cap;
+  int header;                   // 1 once the header is read, -1 if it is invalid
+  int parsed;                   // votes parsed, bad ones included, giving ids
+  int rejected;                 // a vote was rejected by the validation policy
+  vote_t **pending;             // votes parsed from the current read, not yet added
+  int pending_count, pending_cap;
+
+  pthread_mutex_t lock;         // guards everything below
+  pthread_cond_t cond;          // signalled to stop the recompute thread
+  tally_t *tally;               // every vote added so far
+  vote_t **ballots;             // the same votes in id order
+  int ballot_count, ballot_cap;
+  int stop;
+  rcv_live_result_t latest;     // last published result
+  pthread_t recompute;
+};
+
+static void live_push(rcv_live_t *live, vote_t *vote, int reason, long line){
+    vote->id = ++live->parsed;
+    vote->pos = 0;
+    int keep = tally_screen_vote_r(live->ctx, live->tally, vote, reason, live->fname, line);
+    if(keep <= 0) {
+        live->ctx->dealloc(vote);
+        live->rejected = keep < 0;
+        return;
+    }
+    if(live->pending_count == live->pending_cap) {
+        live->pending_cap = live->pending_cap == 0 ? 1024 : live->pending_cap * 2;
+        live->pending = realloc(live->pending, sizeof(vote_t *) * live->pending_cap);
+    }
+    live->pending[live->pending_count++] = vote;
+}
+// Number a vote just read, with the BALLOT_* `reason` it fails
+// validation for, and apply the ctx->validate policy, moving it to the
+// pending votes if it is kept. A rejected vote stops the scan.
+
+static long live_header(rcv_live_t *live, FILE *mem, int end){
+    rcv_ctx_t quiet = *live->ctx;               // not logged until it is complete
+    quiet.log_level = 0;
+    tally_read_header_r(&quiet, live->tally, mem, live->fname);
+    if(feof(mem) && !end) {
+        return 0;
+    }
+    rewind(mem);
+    memset(live->tally, 0, sizeof(tally_t));
+    tally_read_header_r(live->ctx, live->tally, mem, live->fname);
+    int n = live->tally->candidate_count;
+    live->header = n >= 1 && n <= MAX_CANDIDATES && live->tally->candidate_names[n - 1][0] != '\0' ? 1 : -1;
+    return ftell(mem);
+}
+// Read the header from the start of the unparsed bytes in `mem` with
+// tally_read_header_r() once all of it has arrived, which is when the
+// whitespace after the last name has or at the `end` of the stream.
+// Sets `header` to 1 or, for an impossible candidate count or missing
+// names, to -1. Returns the bytes used.
+
+static void live_scan(rcv_live_t *live, char *data, long len, int end){
+    rcv_ctx_t *ctx = live->ctx;
+    if(live->data_len + len > live->data_cap) {
+        while(live->data_len + len > live->data_cap) {
+            live->data_cap = live->data_cap == 0 ? LIVE_READ_SIZE : live->data_cap * 2;
+        }
+        live->data = realloc(live->data, live->data_cap);
+    }
+    memcpy(live->data + live->data_len, data, len);
+    live->data_len += len;
+    if(live->data_len == 0 || live->header < 0) {
+        return;
+    }
+    FILE *mem = fmemopen(live->data, live->data_len, "r");
+    long used = live->header == 0 ? live_header(live, mem, end) : 0;
+    while(live->header > 0 && !live->rejected) {
+        long lines = ctx->stats.lines;
+        vote_t *vote = vote_make_empty_r(ctx);
+        long line = 0;
+        int reason = tally_read_vote_r(ctx, live->tally, mem, vote, &line);
+        if(reason == EOF || (feof(mem) && !end)) {  // nothing left, or a ballot still being written
+            ctx->dealloc(vote);
+            if(reason != EOF) {
+                ctx->stats.lines = lines;
+            }
+            else {
+                used = ftell(mem);
+            }
+            break;
+        }
+        used = ftell(mem);
+        live_push(live, vote, reason, line);
+    }
+    fclose(mem);
+    live->data_len -= used;
+    memmove(live->data, live->data + used, live->data_len);
+}
+// Add newly read bytes to those not parsed yet and read every complete
+// ballot from them with tally_read_vote_r(), exactly as
+// tally_from_stream_r() reads a file, honouring ctx->line_mode and the
+// ctx->validate policy. A ballot is only complete once the whitespace
+// after its last token has arrived, or at the `end` of the stream, so
+// one being written is left for the next read.
+
+static void live_add_pending(rcv_live_t *live){
+    rcv_ctx_t *ctx = live->ctx;
+    pthread_mutex_lock(&live->lock);
+    if(live->ballot_count + live->pending_count > live->ballot_cap) {
+        while(live->ballot_count + live->pending_count > live->ballot_cap) {
+            live->ballot_cap = live->ballot_cap == 0 ? 1024 : live->ballot_cap * 2;
+        }
+        live->ballots = realloc(live->ballots, sizeof(vote_t *) * live->ballot_cap);
+    }
+    for(int i = 0; i < live->pending_count; i++) {
+        vote_t *vote = live->pending[i];
+        live->ballots[live->ballot_count++] = vote;
+        tally_add_vote_r(ctx, live->tally, vote);
+    }
+    pthread_mutex_unlock(&live->lock);
+    if(ctx->log_level >= LOG_FILEIO) {
+        for(int i = 0; i < live->pending_count; i++) {
+            fprintf(ctx->out, "LOG: File '%s' vote ", live->fname);
+            vote_print_r(ctx, live->pending[i]);
+            fprintf(ctx->out, "\n");
+        }
+    }
+    live->pending_count = 0;
+}
+// Add the votes parsed from the last read to the tally and the ballot
+// array, taking the lock once for the whole batch.
+
+static int live_read(rcv_live_t *live, char *buf){
+    while(!live->rejected) {
+        ssize_t got = read(live->fd, buf, LIVE_READ_SIZE);
+        if(got > 0) {
+            live_scan(live, buf, got, 0);
+            return 1;
+        }
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got == 0 && live->follow) {
+            usleep(LIVE_FOLLOW_MS * 1000);
+            continue;
+        }
+        live_scan(live, buf, 0, 1);
+        return 0;
+    }
+    return 0;
+}
+// Read and scan the next block of input, waiting for a followed file to
+// grow. Returns 0 at the end of the stream or once a vote is rejected.
+
+static void live_print(rcv_ctx_t *ctx, rcv_live_result_t *res, tally_t *tally){
+    flockfile(ctx->out);
+    fprintf(ctx->out, "LIVE %ld: %ld ballots, first choices", res->seq, res->ballots);
+    for(int c = 0; c < res->candidate_count; c++) {
+        fprintf(ctx->out, " %s %d%s", tally->candidate_names[c], res->first_counts[c],
+                c < res->candidate_count - 1 ? "," : "");
+    }
+    fprintf(ctx->out, ", invalid %d\n", res->invalid);
+    fprintf(ctx->out, "LIVE %ld: ", res->seq);
+    if(res->sim.condition == TALLY_WINNER) {
+        fprintf(ctx->out, "Winner: %s (candidate %d)", tally->candidate_names[res->sim.winner], res->sim.winner);
+    }
+    else {
+        fprintf(ctx->out, "%s", res->sim.condition == TALLY_TIE ? "Multiway Tie" : "No result");
+    }
+    fprintf(ctx->out, " after %d rounds\n", res->sim.rounds);
+    fflush(ctx->out);
+    funlockfile(ctx->out);
+}
+
+static void *live_recompute(void *arg){
+    rcv_live_t *live = arg;
+    rcv_live_result_t *work = calloc(1, sizeof(rcv_live_result_t));
+    vote_t **copy = NULL;
+    int *scratch = NULL;
+    int cap = 0, counted = 0;
+    pthread_mutex_lock(&live->lock);
+    for(int last = 0; !last; ) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long ns = deadline.tv_nsec + (live->interval_ms % 1000) * 1000000L;
+        deadline.tv_sec += live->interval_ms / 1000 + ns / 1000000000L;
+        deadline.tv_nsec = ns % 1000000000L;
+        while(!live->stop && pthread_cond_timedwait(&live->cond, &live->lock, &deadline) != ETIMEDOUT) {
+        }
+        last = live->stop;
+        if(live->ballot_count == counted || (last && live->rejected)) {
+            continue;
+        }
+        counted = live->ballot_count;           // consistent copy of the ballots and counts
+        if(counted > cap) {
+            cap = counted * 2;
+            copy = realloc(copy, sizeof(vote_t *) * cap);
+            scratch = realloc(scratch, sizeof(int) * 2 * (cap + 1));
+        }
+        memcpy(copy, live->ballots, sizeof(vote_t *) * counted);
+        int n = live->tally->candidate_count;
+        memcpy(work->first_counts, live->tally->candidate_vote_counts, sizeof(int) * n);
+        work->invalid = live->tally->invalid_vote_count;
+        pthread_mutex_unlock(&live->lock);
+
+        double start = rcv_now();               // run the rounds without the lock
+        rcv_ballots_t ballots = {.candidate_count = n, .ballot_count = counted, .ballots = copy};
+        work->sim.round_counts = work->round_counts;
+        work->sim.round_status = NULL;
+        rcv_sim_run(&ballots, NULL, NULL, &work->sim, scratch);
+        work->sim.round_counts = NULL;
+        work->secs = rcv_now() - start;
+        work->ballots = counted;
+        work->candidate_count = n;
+
+        pthread_mutex_lock(&live->lock);
+        work->seq = live->latest.seq + 1;
+        memcpy(&live->latest, work, sizeof(rcv_live_result_t));
+        pthread_mutex_unlock(&live->lock);
+        live_print(live->ctx, work, live->tally);
+        pthread_mutex_lock(&live->lock);
+    }
+    pthread_mutex_unlock(&live->lock);
+    free(copy);
+    free(scratch);
+    free(work);
+    return NULL;
+}
+// Recompute thread: every interval, and once more when stopped at the
+// end of a stream that wasn't rejected, if ballots have arrived since
+// the last result, copy the ballot pointers and first choice counts
+// under the lock, run the full election on the copy with rcv_sim_run(),
+// which only reads the ballots' rankings, then publish and print the
+// result. Ingestion is only held up for the copy. The last result
+// printed thus always covers every ballot.
+
+rcv_live_t *rcv_live_open_r(rcv_ctx_t *ctx, char *fname, int interval_ms, int follow){
+    int is_stdin = strcmp(fname, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+    if(fd < 0) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return NULL;
+    }
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' opened\n", fname);
+    }
+    struct stat st;
+    rcv_live_t *live = calloc(1, sizeof(rcv_live_t));
+    live->ctx = ctx;
+    snprintf(live->fname, sizeof(live->fname), "%s", fname);
+    live->fd = fd;
+    live->own_fd = !is_stdin;
+    live->follow = follow && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    live->interval_ms = interval_ms > 0 ? interval_ms : 1;
+    live->tally = ctx->alloc(sizeof(tally_t));
+    memset(live->tally, 0, sizeof(tally_t));
+    pthread_mutex_init(&live->lock, NULL);
+    pthread_cond_init(&live->cond, NULL);
+
+    char *buf = malloc(LIVE_READ_SIZE);         // the header must arrive before anything else
+    int more = 1;
+    while(more && live->header == 0) {
+        more = live_read(live, buf);
+    }
+    free(buf);
+    if(live->header <= 0) {
+        fprintf(ctx->out, "ERROR: '%s' has no valid header\n", fname);
+        rcv_live_free_r(ctx, live);
+        return NULL;
+    }
+    live_add_pending(live);
+    pthread_create(&live->recompute, NULL, live_recompute, live);
+    return live;
+}
+// Open a live tabulation of vote file `fname`, or standard input for
+// "-", which may be a pipe or FIFO still being written. Waits for the
+// header then starts a thread which re-runs the election every
+// `interval_ms` milliseconds when new ballots have arrived, and at the
+// end of the stream, and prints two lines to ctx->out for each result:
+//
+//   LIVE 2: 12 ballots, first choices Francis 4, Claire 2, Heather 5, Viktor 1, invalid 0
+//   LIVE 2: Winner: Francis (candidate 0) after 3 rounds
+//
+// With `follow` a regular file is read as it grows, like tail -f,
+// rather than ending at its current end. Prints an error and returns
+// NULL if the file can't be opened or has no valid header.
+
+int rcv_live_run_r(rcv_ctx_t *ctx, rcv_live_t *live){
+    char *buf = malloc(LIVE_READ_SIZE);
+    int more = 1;
+    while(more) {
+        more = live_read(live, buf);
+        live_add_pending(live);
+    }
+    free(buf);
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' end of file reached\n", live->fname);
+    }
+    pthread_mutex_lock(&live->lock);
+    live->stop = 1;
+    pthread_cond_broadcast(&live->cond);
+    pthread_mutex_unlock(&live->lock);
+    pthread_join(live->recompute, NULL);
+    if(live->rejected) {
+        return TALLY_ERROR;
+    }
+    return tally_election_r(ctx, live->tally);
+}
+// Read ballots until the end of the stream, adding each batch as it
+// arrives, then stop recomputing once a result covering every ballot
+// is printed and run the complete election with tally_election_r(),
+// printing it exactly as a run on the finished file would. Returns its
+// condition.
+
+long rcv_live_latest(rcv_live_t *live, rcv_live_result_t *result){
+    pthread_mutex_lock(&live->lock);
+    memcpy(result, &live->latest, sizeof(rcv_live_result_t));
+    pthread_mutex_unlock(&live->lock);
+    return result->seq;
+}
+// Copy the latest published result, which always describes one
+// consistent set of ballots, into `result` and return its sequence
+// number, 0 if nothing has been published yet. May be called from any
+// thread while rcv_live_run_r() runs.
+
+void rcv_live_free_r(rcv_ctx_t *ctx, rcv_live_t *live){
+    if(live->own_fd) {
+        close(live->fd);
+    }
+    free(live->data);
+    for(int i = 0; i < live->pending_count; i++) {
+        ctx->dealloc(live->pending[i]);
+    }
+    free(live->pending);
+    free(live->ballots);
+    tally_free_r(ctx, live->tally);
+    pthread_mutex_destroy(&live->lock);
+    pthread_cond_destroy(&live->cond);
+    free(live);
+}
+// De-allocate a live tabulation and its tally, closing its input. Must
+// not be called while rcv_live_run_r() runs.
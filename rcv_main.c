@@ -1,5 +1,1026 @@
 #include "rcv.h"
+#include <unistd.h>
+#include <signal.h>
+
+static int parse_policy(const char *name){
+    return strcmp(name, "invalid") == 0 ? RCV_VALIDATE_INVALID :
+           strcmp(name, "skip") == 0 ? RCV_VALIDATE_SKIP :
+           strcmp(name, "reject") == 0 ? RCV_VALIDATE_REJECT : -1;
+}
+// Returns the RCV_VALIDATE_* policy named by a -policy argument, or -1
+// if it names none so the mode prints its usage line.
+
+static int is_flag(const char *arg){
+    return arg[0] == '-' && arg[1] != '\0';
+}
+// Returns 1 if a command line argument is a flag rather than a file,
+// "-" meaning standard input.
+
+static int flag_left(int argc, char *argv[], int i){
+    for(; i < argc; i++) {
+        if(is_flag(argv[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+// Returns 1 if a flag is among the arguments from i on, which a mode
+// would otherwise take as its files: one given without its value or
+// after the files. The mode then prints its usage line.
+
+// Batch mode: rcv_main -batch <dir|manifest> [-out DIR] [-threads N] [-log N]
+// Tabulates every contest on a thread pool then prints each contest's
+// output, or the file in DIR it was written to, followed by a summary
+// table.
+int batch_main(int argc, char *argv[]){
+    char *outdir = NULL;
+    int nthreads = 0, log_level = 0;
+    for(int i = 3; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "-out") == 0) {
+            outdir = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            log_level = atoi(argv[i + 1]);
+        }
+    }
+
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    rcv_contest_t *contests;
+    int count = rcv_batch_collect_r(&ctx, argv[2], &contests);
+    if(count < 0) {
+        printf("Could not load batch. Exiting with error code 1\n");
+        return 1;
+    }
+    double start = rcv_now();
+    int used = rcv_batch_run(contests, count, log_level, outdir, nthreads);
+    double total = rcv_now() - start;
+
+    for(int i = 0; i < count; i++) {
+        if(outdir != NULL) {
+            printf("=== CONTEST %s written to %s ===\n", contests[i].fname, contests[i].outname);
+            continue;
+        }
+        printf("=== CONTEST %s ===\n", contests[i].fname);
+        fwrite(contests[i].output, 1, contests[i].output_len, stdout);
+    }
+    rcv_batch_print_summary(stdout, contests, count, used, total);
+    rcv_batch_free(contests, count);
+    return 0;
+}
+
+// Shard mode: rcv_main -shards [-log N] [-threads N] FILE...
+// Loads all shard files in parallel into a single election and runs it.
+int shards_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+    }
+    if(argc - i < 1 || flag_left(argc, argv, i)) {
+        printf("usage: %s -shards [-log N] [-threads N] FILE...\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_shards_r(&ctx, &argv[i], argc - i, nthreads);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    tally_election_r(&ctx, tally);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+static volatile sig_atomic_t incr_stop = 0;
+
+static void incr_interrupt(int sig){
+    incr_stop = 1;
+}
+// Signal handler ending the polling loop of incremental mode.
+
+// Incremental mode: rcv_main -incr [-log N] [-poll MS] FILE
+// Runs the election then polls FILE for appended ballots, printing
+// updated results after each batch of them until interrupted by
+// SIGINT or SIGTERM, after which it frees the tally and exits 0.
+int incr_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int poll_ms = 1000;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-poll") == 0) {
+            poll_ms = atoi(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -incr [-log N] [-poll MS] FILE\n", argv[0]);
+        return 1;
+    }
+    rcv_incr_t *incr = rcv_incr_open_r(&ctx, argv[i]);
+    if(incr == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    struct sigaction sa;                        // no SA_RESTART so usleep() is cut short
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = incr_interrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    fflush(stdout);
+    while(!incr_stop) {
+        usleep(poll_ms * 1000);
+        double start = rcv_now();
+        if(!incr_stop && rcv_incr_update_r(&ctx, incr) > 0) {
+            printf("Update took %.3f ms, rounds re-run from %d (0 for none)\n",
+                   (rcv_now() - start) * 1000, incr->replay_round);
+        }
+        fflush(stdout);
+    }
+    rcv_incr_free_r(&ctx, incr);
+    return 0;
+}
+
+// Rerun mode: rcv_main -reruns N FILE
+// Runs the election once with normal output then N more times from a
+// snapshot of the loaded tally, reporting the rerun rate.
+int reruns_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    char *end;
+    long reruns = strtol(argv[2], &end, 10);
+    if(end == argv[2] || *end != '\0' || reruns < 1) {
+        printf("usage: %s -reruns N FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[3]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    tally_snapshot_t *snap = tally_snapshot_r(&ctx, tally);
+    tally_election_r(&ctx, tally);
+
+    rcv_ctx_t quiet = ctx;
+    quiet.out = fopen("/dev/null", "w");
+    double start = rcv_now();
+    for(long i = 0; i < reruns; i++) {
+        tally_restore_r(&quiet, snap);
+        tally_election_r(&quiet, tally);
+    }
+    double secs = rcv_now() - start;
+    fclose(quiet.out);
+    printf("%ld reruns in %.3f s: %.1f reruns per second\n",
+           reruns, secs, secs > 0 ? reruns / secs : 0.0);
+    tally_snapshot_free_r(&ctx, snap);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// What-if mode: rcv_main -whatif [-threads N] FILE
+// Prints the winner with each candidate excluded in turn.
+int whatif_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -whatif [-threads N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_whatif_r(&ctx, tally, nthreads);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Monte Carlo mode:
+// rcv_main -montecarlo [-samples N] [-seed S] [-subset F] [-threads N] FILE
+// Bootstrap resamples by default, or subsets of fraction F of the ballots.
+int montecarlo_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0, samples = 1000, mode = RCV_SAMPLE_BOOTSTRAP;
+    double fraction = 1.0;
+    unsigned long long seed = 1;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-samples") == 0) {
+            samples = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if(strcmp(argv[i], "-subset") == 0) {
+            mode = RCV_SAMPLE_SUBSET;
+            fraction = atof(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -montecarlo [-samples N] [-seed S] [-subset F] [-threads N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_montecarlo_r(&ctx, tally, samples, mode, fraction, seed, nthreads);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Margin mode: rcv_main -margins [-exhaustive] [-threads N] FILE
+// Prints per-round margins and a bound on the margin of victory.
+int margins_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0, exhaustive = 0;
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-exhaustive") == 0) {
+            exhaustive = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -margins [-exhaustive] [-threads N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_margins_r(&ctx, tally, exhaustive, nthreads);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Pairwise mode: rcv_main -pairwise [-threads N] FILE
+// Prints the head-to-head preference matrix and Condorcet winner.
+int pairwise_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -pairwise [-threads N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_pairwise_print_r(&ctx, tally, nthreads);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Transfer report mode:
+// rcv_main -transfers csv|json [-log N] OUTFILE FILE
+// Runs the election as usual and writes per-round transfers to OUTFILE;
+// with OUTFILE "-" only the transfers are printed, to stdout.
+int transfers_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int format = strcmp(argv[2], "json") == 0 ? RCV_TRANSFERS_JSON :
+                 strcmp(argv[2], "csv") == 0 ? RCV_TRANSFERS_CSV : -1;
+    int i = 3;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+    }
+    if(format < 0 || i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -transfers csv|json [-log N] OUTFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    FILE *out = stdout;
+    if(strcmp(argv[i], "-") == 0) {         // report only
+        ctx.out = fopen("/dev/null", "w");
+    }
+    else {
+        out = fopen(argv[i], "w");
+    }
+    if(out == NULL || ctx.out == NULL) {
+        printf("ERROR: couldn't open file '%s'\n", argv[i]);
+        tally_free_r(&ctx, tally);
+        return 1;
+    }
+    rcv_transfers_t *tr = rcv_transfers_open_r(&ctx, tally, out, format);
+    tally_election_r(&ctx, tally);
+    rcv_transfers_close_r(&ctx, tr);
+    if(out != stdout) {
+        fclose(out);
+    }
+    if(ctx.out != stdout) {
+        fclose(ctx.out);
+    }
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Audit mode: rcv_main -audit [-policy invalid|skip|reject] [-log N] AUDITFILE FILE
+// Runs the election as usual recording every transfer in AUDITFILE.
+int audit_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+    }
+    if(ctx.validate < 0 || i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -audit [-policy invalid|skip|reject] [-log N] AUDITFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_audit_t *audit = rcv_audit_open_r(&ctx, argv[i], 1);
+    if(audit == NULL) {
+        tally_free_r(&ctx, tally);
+        return 1;
+    }
+    tally_election_r(&ctx, tally);
+    int ok = rcv_audit_close_r(&ctx, audit);
+    tally_free_r(&ctx, tally);
+    if(!ok) {
+        printf("ERROR: failed writing audit log '%s'\n", argv[i]);
+        return 1;
+    }
+    return 0;
+}
+
+// Audit reader mode:
+// rcv_main -auditread [-id N] [-cand C] [-policy invalid|skip|reject] AUDITFILE FILE
+// Prints the transfers in AUDITFILE, optionally only those of ballot N
+// or from/to candidate C, as the log messages of an election on FILE
+// loaded with the bad ballot policy the log was written under.
+int auditread_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int id = -1, cand = NO_CANDIDATE;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-id") == 0) {
+            id = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-cand") == 0) {
+            cand = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+    }
+    if(ctx.validate < 0 || i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -auditread [-id N] [-cand C] [-policy invalid|skip|reject] AUDITFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    int shown = rcv_audit_print_r(&ctx, argv[i], tally, id, cand);
+    tally_free_r(&ctx, tally);
+    return shown < 0;
+}
+
+// Decision log mode: rcv_main -decisions [-log N] LOGFILE FILE
+// Runs the election as usual writing its decision log to LOGFILE.
+int decisions_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+    }
+    if(i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -decisions [-log N] LOGFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_decisions_write_r(&ctx, tally, argv[i]);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Verify mode: rcv_main -verify [-threads N] LOGFILE FILE
+// Checks a decision log against the ballots; exits 1 if it doesn't match.
+int verify_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+    }
+    if(i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -verify [-threads N] LOGFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    int ok = rcv_decisions_verify_r(&ctx, tally, argv[i], nthreads);
+    tally_free_r(&ctx, tally);
+    return !ok;
+}
+
+// Out-of-core mode: rcv_main -ooc [-mem MB] [-tmpdir DIR] [-log N] FILE
+// Runs the election keeping votes in segment files in DIR, $TMPDIR or
+// /tmp, using buffers of about MB megabytes (default 64) in total.
+int ooc_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    long budget = 64L << 20;
+    char *tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-mem") == 0) {
+            budget = (long) (atof(argv[i + 1]) * (1 << 20));
+        }
+        else if(strcmp(argv[i], "-tmpdir") == 0) {
+            tmpdir = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -ooc [-mem MB] [-tmpdir DIR] [-log N] FILE\n", argv[0]);
+        return 1;
+    }
+    int condition = rcv_ooc_election_r(&ctx, argv[i], budget, tmpdir);
+    return condition == TALLY_ERROR;
+}
+
+// CVR mode: rcv_main -cvr [-policy invalid|skip|reject] [-log N] FILE
+// Loads a cast vote record CSV export, ranking candidates by name,
+// then runs the election. Rows ranking a candidate twice are handled
+// by the validation policy, counted as invalid votes by default, and
+// reported before the rounds if there are any.
+int cvr_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+    }
+    if(ctx.validate < 0 || i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -cvr [-policy invalid|skip|reject] [-log N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_cvr_r(&ctx, argv[i]);
+    long bad = 0;
+    for(int r = 1; r < BALLOT_REASONS; r++) {
+        bad += ctx.stats.bad_ballots[r];
+    }
+    if(bad > 0) {
+        tally_print_bad_ballots_r(&ctx);
+    }
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    tally_election_r(&ctx, tally);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Live mode: rcv_main -live [-interval MS] [-follow] [-policy invalid|skip|reject] [-lines] [-log N] FILE
+// Counts ballots as they arrive on FILE, or standard input for -,
+// re-running the election every MS milliseconds (default 1000) while
+// new ballots come in and once more at the end of the stream, then
+// runs the complete election. With -follow a regular file is read as
+// it grows until the process is interrupted. Bad ballots are handled
+// by -policy and -lines as in validate mode.
+int live_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int interval = 1000, follow = 0;
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-follow") == 0) {
+            follow = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-lines") == 0) {
+            ctx.line_mode = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-interval") == 0) {
+            interval = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(ctx.validate < 0 || i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -live [-interval MS] [-follow] [-policy invalid|skip|reject] [-lines] [-log N] FILE\n", argv[0]);
+        return 1;
+    }
+    rcv_live_t *live = rcv_live_open_r(&ctx, argv[i], interval, follow);
+    if(live == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_live_run_r(&ctx, live);
+    rcv_live_free_r(&ctx, live);
+    return 0;
+}
+
+// Daemon mode: rcv_main -daemon [-threads N] SOCKET
+// Serves tally, whatif, margins and exclude requests on a Unix domain
+// socket until a shutdown request, keeping contests loaded in memory.
+int daemon_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int nthreads = 0;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-threads") == 0) {
+            nthreads = atoi(argv[i + 1]);
+        }
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -daemon [-threads N] SOCKET\n", argv[0]);
+        return 1;
+    }
+    return !rcv_daemon_serve_r(&ctx, argv[i], nthreads);
+}
+
+// Client mode: rcv_main -client [-clients K] [-repeat N] SOCKET REQUEST...
+// Sends the request words as one line to a daemon and prints the
+// answer, or with -clients or -repeat sends it N times on each of K
+// connections and prints the request rate.
+int client_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int clients = 1, repeat = 1;
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-clients") == 0) {
+            clients = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-repeat") == 0) {
+            repeat = atoi(argv[i + 1]);
+        }
+    }
+    if(i + 1 >= argc || flag_left(argc, argv, i) || clients < 1 || repeat < 1) {
+        printf("usage: %s -client [-clients K] [-repeat N] SOCKET REQUEST...\n", argv[0]);
+        return 1;
+    }
+    char request[4096] = "";
+    for(int k = i + 1; k < argc; k++) {
+        snprintf(request + strlen(request), sizeof(request) - strlen(request),
+                 "%s%s", k > i + 1 ? " " : "", argv[k]);
+    }
+    return !rcv_daemon_request_r(&ctx, argv[i], request, clients, repeat);
+}
+
+// Publish mode: rcv_main -publish [-log N] NAME FILE
+// Runs the election publishing each round's table to shared memory
+// region NAME for readers such as -shmread.
+int publish_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int i = 2;
+    for(; i + 1 < argc && is_flag(argv[i]); i += 2) {
+        if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+    }
+    if(i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -publish [-log N] NAME FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_shm_t *shm = rcv_shm_open_r(&ctx, tally, argv[i]);
+    if(shm == NULL) {
+        tally_free_r(&ctx, tally);
+        return 1;
+    }
+    tally_election_r(&ctx, tally);
+    rcv_shm_close_r(&ctx, shm);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Shared memory reader mode: rcv_main -shmread [-watch MS] [-unlink] NAME
+// Prints the round table published in region NAME. With -watch, polls
+// every MS milliseconds printing each new round until the election is
+// over. With -unlink, removes the region afterwards.
+int shmread_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int watch = 0, remove = 0;
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-unlink") == 0) {
+            remove = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-watch") == 0) {
+            watch = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -shmread [-watch MS] [-unlink] NAME\n", argv[0]);
+        return 1;
+    }
+    const rcv_shm_table_t *shared = rcv_shm_attach(argv[i]);
+    if(shared == NULL) {
+        printf("ERROR: no round table published as '%s'\n", argv[i]);
+        return 1;
+    }
+    rcv_shm_table_t *table = malloc(sizeof(rcv_shm_table_t));
+    uint64_t shown = 0;
+    int ok = 0;
+    while(1) {
+        ok = rcv_shm_snapshot(shared, table);
+        if(ok && table->seq != shown) {
+            rcv_shm_print_r(&ctx, table);
+            fflush(stdout);
+            shown = table->seq;
+        }
+        if(watch <= 0 || (ok && table->condition != TALLY_CONTINUE)) {
+            break;
+        }
+        usleep(watch * 1000);
+    }
+    if(!ok) {
+        printf("ERROR: no round table published as '%s'\n", argv[i]);
+    }
+    free(table);
+    rcv_shm_detach(shared);
+    if(remove) {
+        rcv_shm_unlink(argv[i]);
+    }
+    return !ok;
+}
+
+// Cache mode: rcv_main -cache [-dir DIR] [-policy invalid|skip|reject] [-lines] [-log N] FILE
+// Runs the election through the result cache in DIR, by default
+// $RCV_CACHE_DIR or ~/.cache/rcv, printing stored output when FILE, the
+// bad ballot policy, -lines and the log level are unchanged since an
+// earlier run.
+int cache_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    char dir[PATH_MAX];
+    if(getenv("RCV_CACHE_DIR") != NULL) {
+        snprintf(dir, sizeof(dir), "%s", getenv("RCV_CACHE_DIR"));
+    }
+    else {
+        snprintf(dir, sizeof(dir), "%s/.cache/rcv", getenv("HOME") != NULL ? getenv("HOME") : "/tmp");
+    }
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-lines") == 0) {
+            ctx.line_mode = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-dir") == 0) {
+            snprintf(dir, sizeof(dir), "%s", argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(ctx.validate < 0 || i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -cache [-dir DIR] [-policy invalid|skip|reject] [-lines] [-log N] FILE\n", argv[0]);
+        return 1;
+    }
+    if(rcv_cache_election_r(&ctx, argv[i], dir) < 0) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Index mode: rcv_main -index FILE
+// Writes the ballot index FILE.idx used by -ballot.
+int index_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int count = rcv_index_build_r(&ctx, argv[2]);
+    if(count < 0) {
+        return 1;
+    }
+    printf("Indexed %d ballots of '%s'\n", count, argv[2]);
+    return 0;
+}
+
+// Ballot mode: rcv_main -ballot FILE ID...
+// Prints each ballot ID, given as 472 or #0472, through the index built
+// by -index.
+int ballot_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    if(argc < 4) {
+        printf("usage: %s -ballot FILE ID...\n", argv[0]);
+        return 1;
+    }
+    vote_t *vote = malloc(sizeof(vote_t));
+    int ret = 0;
+    for(int i = 3; i < argc; i++) {
+        int id = atoi(argv[i][0] == '#' ? argv[i] + 1 : argv[i]);
+        int found = rcv_index_lookup_r(&ctx, argv[2], id, vote);
+        if(found < 0) {
+            printf("ERROR: no up to date index of '%s', build it with -index\n", argv[2]);
+            ret = 1;
+            break;
+        }
+        if(found == 0) {
+            printf("ERROR: no ballot %s in '%s'\n", argv[i], argv[2]);
+            ret = 1;
+            continue;
+        }
+        vote_print_r(&ctx, vote);
+        printf("\n");
+    }
+    free(vote);
+    return ret;
+}
+
+// Validate mode: rcv_main -validate [-policy invalid|skip|reject] [-lines] [-log N] FILE
+// Loads FILE handling bad ballots by the policy, counting them as
+// invalid votes by default, prints how many failed validation for each
+// reason, then runs the election. With -lines each line is one ballot
+// of any number of rankings and every bad one is reported by line.
+int validate_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-lines") == 0) {
+            ctx.line_mode = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(ctx.validate < 0 || i >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -validate [-policy invalid|skip|reject] [-lines] [-log N] FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i]);
+    tally_print_bad_ballots_r(&ctx);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    tally_election_r(&ctx, tally);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+// Aggregate mode: rcv_main -aggregate FILE
+// Prints FILE as a pre-aggregated vote file with one weighted line per
+// distinct ranking, which elects the same way with far fewer votes.
+int aggregate_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    tally_t *tally = tally_from_file_r(&ctx, argv[2]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    rcv_ballots_print_aggregated_r(&ctx, tally);
+    tally_free_r(&ctx, tally);
+    return 0;
+}
+
+static void checkpoint_stop(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    if(round == *(int *) arg) {
+        fflush(ctx->out);
+        _exit(2);
+    }
+}
+// Round hook ending the process abruptly after a given round, as if it
+// were killed, so that resuming can be tried out.
+
+// Checkpoint mode:
+// rcv_main -checkpoint [-resume] [-stop R] [-policy invalid|skip|reject] [-log N] CKPTFILE FILE
+// Runs the election checkpointing every round to CKPTFILE. With -resume
+// it continues from CKPTFILE if it exists; -stop R exits with code 2
+// just after round R is checkpointed.
+int checkpoint_main(int argc, char *argv[]){
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    int resume = 0, stop = 0;
+    int i = 2;
+    while(i + 1 < argc && is_flag(argv[i])) {
+        if(strcmp(argv[i], "-resume") == 0) {
+            resume = 1;
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-stop") == 0) {
+            stop = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-policy") == 0) {
+            ctx.validate = parse_policy(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-log") == 0) {
+            ctx.log_level = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+    if(ctx.validate < 0 || i + 1 >= argc || flag_left(argc, argv, i)) {
+        printf("usage: %s -checkpoint [-resume] [-stop R] [-policy invalid|skip|reject] [-log N] CKPTFILE FILE\n", argv[0]);
+        return 1;
+    }
+    tally_t *tally = tally_from_file_r(&ctx, argv[i + 1]);
+    if(tally == NULL) {
+        printf("Could not load votes file. Exiting with error code 1\n");
+        return 1;
+    }
+    int round = 0;
+    rcv_checkpoint_t *ckpt = rcv_checkpoint_open_r(&ctx, tally, argv[i], resume ? &round : NULL);
+    if(ckpt == NULL) {
+        tally_free_r(&ctx, tally);
+        return 1;
+    }
+    if(stop > 0) {
+        rcv_ctx_add_round_hook(&ctx, checkpoint_stop, &stop);
+    }
+    tally_election_resume_r(&ctx, tally, round);
+    int ok = rcv_checkpoint_close_r(&ctx, ckpt);
+    tally_free_r(&ctx, tally);
+    if(!ok) {
+        printf("ERROR: failed writing checkpoint '%s'\n", argv[i]);
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]){
+    if(argc >= 3 && strcmp(argv[1], "-batch") == 0) {
+        return batch_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-montecarlo") == 0) {
+        return montecarlo_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-margins") == 0) {
+        return margins_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-pairwise") == 0) {
+        return pairwise_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-transfers") == 0) {
+        return transfers_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-audit") == 0) {
+        return audit_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-auditread") == 0) {
+        return auditread_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-decisions") == 0) {
+        return decisions_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-verify") == 0) {
+        return verify_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-checkpoint") == 0) {
+        return checkpoint_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-ooc") == 0) {
+        return ooc_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-cvr") == 0) {
+        return cvr_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-live") == 0) {
+        return live_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-daemon") == 0) {
+        return daemon_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-client") == 0) {
+        return client_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-publish") == 0) {
+        return publish_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-shmread") == 0) {
+        return shmread_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-cache") == 0) {
+        return cache_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-index") == 0) {
+        return index_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-ballot") == 0) {
+        return ballot_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-aggregate") == 0) {
+        return aggregate_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-validate") == 0) {
+        return validate_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-whatif") == 0) {
+        return whatif_main(argc, argv);
+    }
+    if(argc == 4 && strcmp(argv[1], "-reruns") == 0) {
+        return reruns_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-incr") == 0) {
+        return incr_main(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "-shards") == 0) {
+        return shards_main(argc, argv);
+    }
     if(argc == 2) {
         tally_t *tally = tally_from_file(argv[1]);
         if(tally != NULL) {
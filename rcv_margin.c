@@ -0,0 +1,306 @@
+// rcv_margin.c: Margin of victory: how few changed ballots would alter
+// each round's elimination and the overall outcome.
+
+#include "rcv.h"
+#include <pthread.h>
+
+static void margin_name(char *buf, size_t size, tally_t *tally, int cand){
+    if(cand == NO_CANDIDATE) {
+        snprintf(buf, size, "-");
+    }
+    else {
+        snprintf(buf, size, "%d %s", cand, tally->candidate_names[cand]);
+    }
+}
+
+typedef struct {                // Arguments shared by all margin re-runs
+  rcv_ballots_t *ballots;       // tally ballots followed by one bullet ballot per candidate
+  vote_t *bullets;              // bullet ballot ranking only each candidate
+  int real_count;               // ballots from the tally, before the bullet ballots
+  int **firsts;                 // indices of ballots ranking each candidate first, in id order
+  int *first_counts;            // length of each firsts[] list
+  int *first_weights;           // ballots those lists stand for, their summed weights
+  int winner;                   // actual winner
+  int nthreads;                 // workers with scratch space below
+  int **weights;                // per-worker weight vector
+  int **scratch;                // per-worker simulation scratch
+  pthread_mutex_t lock;         // guards the best change found so far
+  int best_k;                   // fewest changed ballots found to alter the outcome
+  int best_task;                // task that found it, lowest index among equal best_k
+  int best_winner;              // outcome with that change, NO_CANDIDATE for a tie
+} margin_job_t;
+
+static int margin_pruned(margin_job_t *job, int k, int task){
+    pthread_mutex_lock(&job->lock);
+    int pruned = k > job->best_k || (k == job->best_k && task > job->best_task);
+    pthread_mutex_unlock(&job->lock);
+    return pruned;
+}
+// Whether changing `k` ballots in `task` can't improve on the best
+// change already found.
+
+static int margin_try(margin_job_t *job, int from, int to, int k, int worker, int *outcome){
+    int *weights = job->weights[worker];
+    for(int b = 0; b < job->ballots->ballot_count; b++) {
+        weights[b] = b < job->real_count ? job->ballots->ballots[b]->weight : 0;
+    }
+    for(int j = 0, left = k; left > 0; j++) {
+        int b = job->firsts[from][j];
+        int take = left < weights[b] ? left : weights[b];
+        weights[b] -= take;
+        left -= take;
+    }
+    weights[job->real_count + to] = k;
+    rcv_sim_result_t res = {0};
+    rcv_sim_run(job->ballots, NULL, weights, &res, job->scratch[worker]);
+    *outcome = res.condition == TALLY_WINNER ? res.winner : NO_CANDIDATE;
+    return res.condition != TALLY_WINNER || res.winner != job->winner;
+}
+// Re-run the election with the first `k` ballots ranking `from` first
+// replaced by `k` ballots ranking only `to`, using the scratch space
+// of `worker`. A weighted vote counts as that many ballots, the last
+// one taken only losing part of its weight. Sets `outcome` to the new
+// winner or NO_CANDIDATE for a tie and returns 1 if the outcome
+// differs from the actual one.
+
+static void margin_record(margin_job_t *job, int k, int task, int outcome){
+    pthread_mutex_lock(&job->lock);
+    if(k < job->best_k || (k == job->best_k && task < job->best_task)) {
+        job->best_k = k;
+        job->best_task = task;
+        job->best_winner = outcome;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+// Keep the change of `k` ballots made by `task` if it beats the best
+// so far; ties go to the lowest task index so the reported change does
+// not depend on scheduling.
+
+static void margin_task(void *arg, int task, int worker){
+    margin_job_t *job = arg;
+    int n = job->ballots->candidate_count;
+    int from = task / n, to = task % n;
+    if(from == to) {
+        return;
+    }
+    for(int k = 1; k <= job->first_weights[from] && !margin_pruned(job, k, task); k++) {
+        int outcome;
+        if(margin_try(job, from, to, k, worker, &outcome)) {
+            margin_record(job, k, task, outcome);
+            return;
+        }
+    }
+}
+// Exhaustive search task `from*n + to` tries k = 1, 2, ... changed
+// ballots from `from` to `to` until the outcome changes or k can no
+// longer beat the best change found by any task.
+
+static void margin_job_init(margin_job_t *job, rcv_ballots_t *ballots, int winner, int nthreads){
+    int n = ballots->candidate_count;
+    int nb = ballots->ballot_count;
+    memset(job, 0, sizeof(*job));
+    job->ballots = malloc(sizeof(rcv_ballots_t));
+    job->ballots->candidate_count = n;
+    job->ballots->ballot_count = nb + n;
+    job->ballots->ballots = malloc(sizeof(vote_t *) * (nb + n));
+    memcpy(job->ballots->ballots, ballots->ballots, sizeof(vote_t *) * nb);
+    job->bullets = calloc(n, sizeof(vote_t));
+    for(int c = 0; c < n; c++) {
+        job->bullets[c].id = nb + c + 1;
+        job->bullets[c].weight = 1;
+        job->bullets[c].candidate_order[0] = c;
+        for(int p = 1; p < MAX_CANDIDATES; p++) {
+            job->bullets[c].candidate_order[p] = NO_CANDIDATE;
+        }
+        job->ballots->ballots[nb + c] = &job->bullets[c];
+    }
+    job->real_count = nb;
+    job->winner = winner;
+    job->best_k = INT_MAX;
+    job->best_task = n * n;
+    job->best_winner = NO_CANDIDATE;
+    pthread_mutex_init(&job->lock, NULL);
+
+    job->firsts = calloc(n, sizeof(int *));
+    job->first_counts = calloc(n, sizeof(int));
+    job->first_weights = calloc(n, sizeof(int));
+    for(int c = 0; c < n; c++) {
+        job->firsts[c] = malloc(sizeof(int) * (nb + 1));
+    }
+    for(int b = 0; b < nb; b++) {
+        int first = ballots->ballots[b]->candidate_order[0];
+        if(first != NO_CANDIDATE) {
+            job->firsts[first][job->first_counts[first]++] = b;
+            job->first_weights[first] += ballots->ballots[b]->weight;
+        }
+    }
+    job->nthreads = nthreads;
+    job->weights = malloc(sizeof(int *) * nthreads);
+    job->scratch = malloc(sizeof(int *) * nthreads);
+    for(int t = 0; t < nthreads; t++) {
+        job->weights[t] = malloc(sizeof(int) * (nb + n));
+        job->scratch[t] = malloc(sizeof(int) * 2 * (nb + n + 1));
+    }
+}
+// Set up the ballots of the tally followed by one bullet ballot per
+// candidate, whose weights are used to stand in for changed ballots,
+// the ballots ranking each candidate first in id order and scratch
+// space for `nthreads` workers.
+
+static void margin_job_free(margin_job_t *job){
+    int n = job->ballots->candidate_count;
+    for(int t = 0; t < job->nthreads; t++) {
+        free(job->weights[t]);
+        free(job->scratch[t]);
+    }
+    for(int c = 0; c < n; c++) {
+        free(job->firsts[c]);
+    }
+    free(job->weights);
+    free(job->scratch);
+    free(job->firsts);
+    free(job->first_counts);
+    free(job->first_weights);
+    pthread_mutex_destroy(&job->lock);
+    free(job->bullets);
+    free(job->ballots->ballots);
+    free(job->ballots);
+}
+
+static void margin_print_best(rcv_ctx_t *ctx, tally_t *tally, margin_job_t *job){
+    int n = tally->candidate_count;
+    char from[MAX_NAME + 16], to[MAX_NAME + 16], result[MAX_NAME + 16];
+    margin_name(from, sizeof(from), tally, job->best_task / n);
+    margin_name(to, sizeof(to), tally, job->best_task % n);
+    margin_name(result, sizeof(result), tally, job->best_winner);
+    fprintf(ctx->out, "%d ballots: changing %s to %s gives %s\n", job->best_k, from, to,
+            job->best_winner == NO_CANDIDATE ? "Multiway Tie" : result);
+}
+// Print the best change found, as "K ballots: changing X to Y gives Z"
+
+void rcv_margins_r(rcv_ctx_t *ctx, tally_t *tally, int exhaustive, int nthreads){
+    int n = tally->candidate_count;
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    int (*round_counts)[MAX_CANDIDATES] = calloc(MAX_CANDIDATES + 1, sizeof(*round_counts));
+    char (*round_status)[MAX_CANDIDATES] = calloc(MAX_CANDIDATES + 1, sizeof(*round_status));
+    rcv_sim_result_t res = {.round_counts = round_counts, .round_status = round_status};
+    rcv_sim_run(&ballots, NULL, NULL, &res, NULL);
+
+    fprintf(ctx->out, "%5s %-24s %6s %-24s %6s %6s\n",
+            "ROUND", "ELIMINATED", "VOTES", "NEXT LOWEST", "VOTES", "MARGIN");
+    for(int r = 1; r <= res.rounds; r++) {
+        int out = NO_CANDIDATE, next = NO_CANDIDATE;
+        for(int c = 0; c < n; c++) {
+            if(round_status[r][c] == CAND_MINVOTES && out == NO_CANDIDATE) {
+                out = c;
+            }
+            else if(round_status[r][c] == CAND_ACTIVE &&
+                    (next == NO_CANDIDATE || round_counts[r][c] < round_counts[r][next])) {
+                next = c;
+            }
+        }
+        char outname[MAX_NAME + 16], nextname[MAX_NAME + 16];
+        margin_name(outname, sizeof(outname), tally, out);
+        margin_name(nextname, sizeof(nextname), tally, next);
+        if(next == NO_CANDIDATE) {              // everyone left is tied
+            fprintf(ctx->out, "%5d %-24s %6d %-24s %6s %6s\n",
+                    r, outname, round_counts[r][out], nextname, "-", "-");
+            continue;
+        }
+        int margin = (round_counts[r][next] - round_counts[r][out] + 1) / 2;
+        fprintf(ctx->out, "%5d %-24s %6d %-24s %6d %6d\n",
+                r, outname, round_counts[r][out], nextname, round_counts[r][next], margin);
+    }
+
+    if(res.condition != TALLY_WINNER || res.rounds == 0) {
+        fprintf(ctx->out, "No contested rounds: margin of victory undefined\n");
+        free(round_counts);
+        free(round_status);
+        rcv_ballots_free(&ballots);
+        return;
+    }
+
+    if(nthreads < 1) {
+        nthreads = rcv_pool_threads();
+    }
+    int w = res.winner;
+    margin_job_t job;
+    margin_job_init(&job, &ballots, w, nthreads);
+
+    // Final round: give the top loser enough of the winner's ballots to draw level
+    int last = res.rounds, loser = NO_CANDIDATE;
+    for(int c = 0; c < n; c++) {
+        if(round_status[last][c] == CAND_MINVOTES && loser == NO_CANDIDATE) {
+            loser = c;
+        }
+    }
+    int k = (round_counts[last][w] - round_counts[last][loser] + 1) / 2;
+    int outcome;
+    if(k <= job.first_weights[w] && margin_try(&job, w, loser, k, 0, &outcome)) {
+        margin_record(&job, k, w * n + loser, outcome);
+    }
+
+    // Round 1: take the winner down to the lowest rival's count by
+    // giving ballots to a third candidate
+    int low = NO_CANDIDATE, third = NO_CANDIDATE;
+    for(int c = 0; c < n; c++) {
+        if(c != w && (low == NO_CANDIDATE || round_counts[1][c] < round_counts[1][low])) {
+            low = c;
+        }
+    }
+    for(int c = 0; c < n && third == NO_CANDIDATE; c++) {
+        if(c != w && c != low) {
+            third = c;
+        }
+    }
+    k = round_counts[1][w] - round_counts[1][low];
+    if(third != NO_CANDIDATE && k >= 1 && k <= job.first_weights[w] &&
+       margin_try(&job, w, third, k, 0, &outcome)) {
+        margin_record(&job, k, w * n + third, outcome);
+    }
+
+    if(job.best_task < n * n) {
+        fprintf(ctx->out, "Upper bound on margin of victory: ");
+        margin_print_best(ctx, tally, &job);
+    }
+    else {
+        fprintf(ctx->out, "Upper bound on margin of victory: not found\n");
+    }
+    if(exhaustive) {
+        rcv_pool_run(nthreads, n * n, margin_task, &job);
+        if(job.best_task < n * n) {
+            fprintf(ctx->out, "Exhaustive search: ");
+            margin_print_best(ctx, tally, &job);
+        }
+        else {
+            fprintf(ctx->out, "Exhaustive search: no change found\n");
+        }
+    }
+    margin_job_free(&job);
+    free(round_counts);
+    free(round_status);
+    rcv_ballots_free(&ballots);
+}
+// Print the margin of each round of the election: the candidate
+// eliminated, the next lowest candidate still in the race and the
+// number of ballots which, changed from the second to the first,
+// would bring them level and so alter that round's elimination. When
+// several candidates tie for elimination the lowest numbered is shown.
+// All figures come from one run over the ballots rather than a rerun
+// per candidate.
+//
+// An upper bound on the margin of victory is then taken from two
+// changes suggested by the round counts: moving ballots from the
+// winner to the top loser of the final round until they draw level,
+// and taking the winner down to the lowest rival in round 1. Since
+// transfers can undo either, each is checked with one re-run and only
+// those that alter the outcome count; the smaller is printed as
+// "Upper bound on margin of victory: K ballots: changing X to Y gives Z"
+//
+// If `exhaustive` is non-zero every change of the first K ballots
+// ranking one candidate first to ballots ranking only another is
+// tried, each ordered pair of candidates a task on up to `nthreads`
+// threads. Tasks stop as soon as K reaches the best change found so
+// far, so most pairs need only a few re-runs, and the smallest is
+// printed in the same form. The tally is not changed.
@@ -0,0 +1,324 @@
+// rcv_ooc.c: Out-of-core elections for vote files too large to hold in
+// memory as vote_t lists. Each candidate's pile of votes, and the
+// invalid votes, live in a segment file of fixed size records
+//
+//   int32 id, weight; int16 pos; int16 candidate_order[candidate_count]
+//
+// used as a stack: votes are pushed by appending and popped from the
+// end, which is the order in which tally_add_vote_r() pushes onto and
+// tally_transfer_first_vote_r() pops from the front of a list. Rounds
+// therefore transfer votes in exactly the order tally_election_r()
+// does. The top of each stack is held in a memory buffer; all buffers
+// together fit in the memory budget whatever the number of votes.
+
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct {                // One candidate's votes on disk
+  int fd;                       // unlinked segment file
+  long file_recs;               // records in the file, below those in buf
+  char *buf;                    // top of the stack not yet written
+  int buf_recs;
+} ooc_seg_t;
+
+typedef struct {                // Out-of-core election state
+  int candidate_count;
+  int rec_size;                 // bytes per record
+  int buf_cap;                  // records per buffer
+  ooc_seg_t segs[MAX_CANDIDATES + 1];  // segment candidate_count is the invalid votes
+  char *read_buf;               // for reading segments back from disk
+  vote_t vote;                  // scratch vote, candidate_order[] past candidate_count stays NO_CANDIDATE
+  int error;                    // set if any read or write failed
+} ooc_t;
+
+typedef void (*ooc_vote_fn)(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc, vote_t *vote, void *arg);
+
+static void ooc_pack(ooc_t *ooc, char *rec, vote_t *vote){
+    int32_t id = vote->id, weight = vote->weight;
+    int16_t pos = vote->pos;
+    memcpy(rec, &id, 4);
+    memcpy(rec + 4, &weight, 4);
+    memcpy(rec + 8, &pos, 2);
+    for(int i = 0; i < ooc->candidate_count; i++) {
+        int16_t cand = vote->candidate_order[i];
+        memcpy(rec + 10 + 2 * i, &cand, 2);
+    }
+}
+
+static vote_t *ooc_unpack(ooc_t *ooc, char *rec){
+    int32_t id, weight;
+    int16_t pos;
+    memcpy(&id, rec, 4);
+    memcpy(&weight, rec + 4, 4);
+    memcpy(&pos, rec + 8, 2);
+    ooc->vote.id = id;
+    ooc->vote.weight = weight;
+    ooc->vote.pos = pos;
+    for(int i = 0; i < ooc->candidate_count; i++) {
+        int16_t cand;
+        memcpy(&cand, rec + 10 + 2 * i, 2);
+        ooc->vote.candidate_order[i] = cand;
+    }
+    return &ooc->vote;
+}
+// Convert between a vote and its record; unpacking fills the scratch
+// vote, which is only valid until the next unpack.
+
+static void ooc_push(ooc_t *ooc, int seg_index, vote_t *vote){
+    ooc_seg_t *seg = &ooc->segs[seg_index];
+    if(seg->buf_recs == ooc->buf_cap) {         // spill the buffer below the new top
+        size_t bytes = (size_t) ooc->buf_cap * ooc->rec_size;
+        if(pwrite(seg->fd, seg->buf, bytes, seg->file_recs * ooc->rec_size) != (ssize_t) bytes) {
+            ooc->error = 1;
+        }
+        seg->file_recs += ooc->buf_cap;
+        seg->buf_recs = 0;
+    }
+    ooc_pack(ooc, seg->buf + (size_t) seg->buf_recs * ooc->rec_size, vote);
+    seg->buf_recs++;
+}
+// Push a vote on top of a segment, writing out the full buffer first.
+
+static void ooc_walk(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc, int seg_index, int drain,
+                     ooc_vote_fn fn, void *arg){
+    ooc_seg_t *seg = &ooc->segs[seg_index];
+    for(int r = seg->buf_recs - 1; r >= 0; r--) {
+        fn(ctx, tally, ooc, ooc_unpack(ooc, seg->buf + (size_t) r * ooc->rec_size), arg);
+    }
+    long end = seg->file_recs;
+    while(end > 0) {                            // then the file a buffer at a time from its end
+        long chunk = end < ooc->buf_cap ? end : ooc->buf_cap;
+        size_t bytes = (size_t) chunk * ooc->rec_size;
+        if(pread(seg->fd, ooc->read_buf, bytes, (end - chunk) * ooc->rec_size) != (ssize_t) bytes) {
+            ooc->error = 1;
+            break;
+        }
+        for(long r = chunk - 1; r >= 0; r--) {
+            fn(ctx, tally, ooc, ooc_unpack(ooc, ooc->read_buf + r * ooc->rec_size), arg);
+        }
+        end -= chunk;
+    }
+    if(drain) {
+        seg->buf_recs = 0;
+        seg->file_recs = 0;
+        if(ftruncate(seg->fd, 0) != 0) {
+            ooc->error = 1;
+        }
+    }
+}
+// Call `fn` on every vote of a segment from the top of the stack down,
+// i.e. in the order of the corresponding list. With `drain` the
+// segment is emptied afterwards; `fn` must not push onto the segment
+// being walked.
+
+static void ooc_transfer(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc, vote_t *vote, void *arg){
+    int from = *(int *) arg;
+    int to = vote_next_candidate(vote, tally->candidate_status);
+    tally->candidate_vote_counts[from] -= vote->weight;
+    if(to == NO_CANDIDATE) {
+        tally->invalid_vote_count += vote->weight;
+        ooc_push(ooc, tally->candidate_count, vote);
+    }
+    else {
+        tally->candidate_vote_counts[to] += vote->weight;
+        ooc_push(ooc, to, vote);
+    }
+    ctx->stats.votes_transferred++;
+    for(int i = 0; i < ctx->transfer_hook_count; i++) {
+        ctx->transfer_hooks[i](ctx, tally, vote, from, to, ctx->transfer_hook_args[i]);
+    }
+    if(ctx->log_level >= LOG_VOTE_TRANSFERS) {
+        fprintf(ctx->out, "LOG: Transferred Vote ");
+        vote_print_r(ctx, vote);
+        if(to == NO_CANDIDATE) {
+            fprintf(ctx->out, " from %d %s to Invalid Votes\n", from, tally->candidate_names[from]);
+        }
+        else {
+            fprintf(ctx->out, " from %d %s to %d %s\n", from, tally->candidate_names[from],
+                    to, tally->candidate_names[to]);
+        }
+    }
+}
+// Move one vote popped from candidate `*arg` as
+// tally_transfer_first_vote_r() does, including its hooks and log.
+
+static void ooc_print_vote(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc, vote_t *vote, void *arg){
+    fprintf(ctx->out, "  ");
+    vote_print_r(ctx, vote);
+    fprintf(ctx->out, "\n");
+}
+
+static void ooc_drop_minvote_candidates(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc){
+    for(int i = 0; i < tally->candidate_count; i++) {
+        if(tally->candidate_status[i] == CAND_MINVOTES) {
+            ooc_walk(ctx, tally, ooc, i, 1, ooc_transfer, &i);
+            tally->candidate_status[i] = CAND_DROPPED;
+            ctx->stats.candidates_dropped++;
+            if(ctx->log_level >= LOG_DROP_MINVOTES) {
+                fprintf(ctx->out, "LOG: Dropped Candidate %d: %s\n", i, tally->candidate_names[i]);
+            }
+        }
+    }
+}
+// tally_drop_minvote_candidates_r() on segments.
+
+static void ooc_print_votes(rcv_ctx_t *ctx, tally_t *tally, ooc_t *ooc){
+    for(int i = 0; i < tally->candidate_count; i++) {
+        fprintf(ctx->out, "VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
+        ooc_walk(ctx, tally, ooc, i, 0, ooc_print_vote, NULL);
+        fprintf(ctx->out, "%d votes total\n", tally->candidate_vote_counts[i]);
+    }
+    if(tally->invalid_vote_count > 0) {
+        fprintf(ctx->out, "INVALID VOTES\n");
+        ooc_walk(ctx, tally, ooc, tally->candidate_count, 0, ooc_print_vote, NULL);
+        fprintf(ctx->out, "%d votes total\n", tally->invalid_vote_count);
+    }
+}
+// tally_print_votes_r() on segments.
+
+static int ooc_open(rcv_ctx_t *ctx, ooc_t *ooc, int n, long budget, char *tmpdir){
+    ooc->candidate_count = n;
+    ooc->rec_size = 10 + 2 * n;
+    long cap = budget / ((long) (n + 2) * ooc->rec_size);   // n+1 segments and the read buffer
+    ooc->buf_cap = cap < 1 ? 1 : cap > INT_MAX / ooc->rec_size ? INT_MAX / ooc->rec_size : cap;
+    for(int i = 0; i < MAX_CANDIDATES; i++) {
+        ooc->vote.candidate_order[i] = NO_CANDIDATE;
+    }
+    ooc->vote.next = NULL;
+
+    char path[strlen(tmpdir) + 32];
+    for(int s = 0; s <= n; s++) {
+        snprintf(path, sizeof(path), "%s/rcv-ooc-XXXXXX", tmpdir);
+        ooc->segs[s].fd = mkstemp(path);
+        if(ooc->segs[s].fd < 0) {
+            for(int t = 0; t < s; t++) {
+                close(ooc->segs[t].fd);
+                free(ooc->segs[t].buf);
+            }
+            fprintf(ctx->out, "ERROR: couldn't create segment files in '%s'\n", tmpdir);
+            return 0;
+        }
+        unlink(path);
+        ooc->segs[s].buf = malloc((size_t) ooc->buf_cap * ooc->rec_size);
+    }
+    ooc->read_buf = malloc((size_t) ooc->buf_cap * ooc->rec_size);
+    return 1;
+}
+// Create one segment file per candidate plus one for invalid votes in
+// `tmpdir`, unlinking each straight away so they vanish when closed or
+// if the process dies, and size the buffers so that all n+2 of them
+// fit in `budget` bytes, with at least one record each.
+
+static void ooc_close(ooc_t *ooc){
+    for(int s = 0; s <= ooc->candidate_count; s++) {
+        close(ooc->segs[s].fd);
+        free(ooc->segs[s].buf);
+    }
+    free(ooc->read_buf);
+}
+
+int rcv_ooc_election_r(rcv_ctx_t *ctx, char *fname, long budget, char *tmpdir){
+    FILE *file = rcv_input_open(fname);
+    if(file == NULL) {
+        fprintf(ctx->out, "ERROR: couldn't open file '%s'\n", fname);
+        return TALLY_ERROR;
+    }
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' opened\n", fname);
+    }
+    tally_t *tally = calloc(1, sizeof(tally_t));
+    tally_read_header_r(ctx, tally, file, fname);
+    int n = tally->candidate_count;
+    ooc_t *ooc = calloc(1, sizeof(ooc_t));
+    if(n < 1 || n > MAX_CANDIDATES || !ooc_open(ctx, ooc, n, budget, tmpdir)) {
+        if(n < 1 || n > MAX_CANDIDATES) {
+            fprintf(ctx->out, "ERROR: '%s' has an invalid candidate count %d\n", fname, n);
+        }
+        fclose(file);
+        free(ooc);
+        free(tally);
+        return TALLY_ERROR;
+    }
+
+    vote_t *vote = &ooc->vote;                  // load, one vote at a time
+    for(int i = 0; i < n; i++) {
+        vote->candidate_order[i] = NO_CANDIDATE;
+    }
+    vote->weight = 1;
+    int reason;
+    long line;
+    for(int id = 1; (reason = tally_read_vote_r(ctx, tally, file, vote, &line)) != EOF; id++) {
+        vote->id = id;
+        vote->pos = 0;
+        int keep = tally_screen_vote_r(ctx, tally, vote, reason, fname, line);
+        if(keep < 0) {                          // rejected by the validation policy
+            fclose(file);
+            ooc_close(ooc);
+            free(ooc);
+            free(tally);
+            return TALLY_ERROR;
+        }
+        int first = vote->candidate_order[0];
+        if(keep > 0 && first == NO_CANDIDATE) {
+            tally->invalid_vote_count += vote->weight;
+            ooc_push(ooc, n, vote);
+        }
+        else if(keep > 0) {
+            tally->candidate_vote_counts[first] += vote->weight;
+            ooc_push(ooc, first, vote);
+        }
+        if(keep > 0) {
+            ctx->stats.votes_added++;
+        }
+        if(keep > 0 && ctx->log_level >= LOG_FILEIO) {
+            fprintf(ctx->out, "LOG: File '%s' vote ", fname);
+            vote_print_r(ctx, vote);
+            fprintf(ctx->out, "\n");
+        }
+        for(int i = 0; i < n; i++) {            // as a fresh vote_make_empty_r() vote
+            vote->candidate_order[i] = NO_CANDIDATE;
+        }
+        vote->weight = 1;
+    }
+    if(ctx->log_level >= LOG_FILEIO) {
+        fprintf(ctx->out, "LOG: File '%s' end of file reached\n", fname);
+    }
+    fclose(file);
+
+    int round = 0;                              // rounds as tally_election_resume_r()
+    ctx->stats.winner = NO_CANDIDATE;
+    while(tally_condition(tally) == TALLY_CONTINUE) {
+        fprintf(ctx->out, "=== ROUND %d ===\n", ++round);
+        ooc_drop_minvote_candidates(ctx, tally, ooc);
+        tally_print_table_r(ctx, tally);
+        if(ctx->log_level >= LOG_SHOWVOTES) {
+            ooc_print_votes(ctx, tally, ooc);
+        }
+        tally_set_minvote_candidates_r(ctx, tally);
+        for(int i = 0; i < ctx->round_hook_count; i++) {
+            ctx->round_hooks[i](ctx, tally, round, ctx->round_hook_args[i]);
+        }
+    }
+    ctx->stats.rounds = round;
+    int condition = tally_print_result_r(ctx, tally);
+    if(ooc->error) {
+        fprintf(ctx->out, "ERROR: reading or writing segment files failed\n");
+        condition = TALLY_ERROR;
+    }
+    ooc_close(ooc);
+    free(ooc);
+    free(tally);
+    return condition;
+}
+// Run the election in vote file `fname` with the same rounds, output,
+// hooks and stats as loading it with tally_from_file_r() then running
+// tally_election_r(), but keeping votes in segment files created in
+// `tmpdir` instead of memory. Memory use is about `budget` bytes for
+// the segment buffers plus a fixed tally, whatever the number of
+// votes; the file is read once and each round streams only the
+// segments of the candidates it drops. Round hooks receive a tally with
+// correct counts and statuses but empty vote lists and transfer hooks
+// a vote valid only during the call. Ballots are validated as
+// tally_read_votes_r() does. Returns the final condition or TALLY_ERROR
+// if the file can't be read, is rejected or a segment fails.
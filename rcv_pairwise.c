@@ -0,0 +1,153 @@
+// rcv_pairwise.c: Head-to-head (Condorcet) preference matrix of an
+// election, used alongside the RCV result to flag center squeeze.
+
+#include "rcv.h"
+
+#define PAIRWISE_CHUNKS 256     // ballot ranges handed to the pool
+
+typedef struct {                // Arguments shared by all pairwise tasks
+  const rcv_ballots_t *ballots;
+  const int *weights;           // weight of each ballot or NULL for 1
+  int chunk;                    // ballots per task
+  long **partial;               // per-worker n*n matrix of corrections
+  long **ranked;                // per-worker weight of ballots ranking each candidate
+} pairwise_job_t;
+
+static void pairwise_task(void *arg, int task, int worker){
+    pairwise_job_t *job = arg;
+    int n = job->ballots->candidate_count;
+    long *mat = job->partial[worker];
+    long *ranked = job->ranked[worker];
+    int end = (task + 1) * job->chunk;
+    if(end > job->ballots->ballot_count) {
+        end = job->ballots->ballot_count;
+    }
+    for(int b = task * job->chunk; b < end; b++) {
+        long w = job->weights == NULL ? job->ballots->ballots[b]->weight : job->weights[b];
+        const int *order = job->ballots->ballots[b]->candidate_order;
+        for(int p = 0; p < n && order[p] != NO_CANDIDATE; p++) {
+            long *row = mat + (long) order[p] * n;
+            ranked[order[p]] += w;
+            for(int q = 0; q <= p; q++) {
+                row[order[q]] -= w;
+            }
+        }
+    }
+}
+// Count one range of ballots. A ballot ranking candidate a at position
+// p prefers a to every candidate except those at positions 0..p, so
+// rather than update all n entries of row a it adds its weight to
+// ranked[a] once and subtracts it from the p+1 entries it does not
+// win, including a itself so the diagonal comes out 0. This makes each
+// ballot cost the square of its ranking length, not of the number of
+// candidates.
+
+long *rcv_pairwise(const rcv_ballots_t *ballots, const int *weights, int nthreads){
+    int n = ballots->candidate_count;
+    int nb = ballots->ballot_count;
+    if(nthreads < 1) {
+        nthreads = rcv_pool_threads();
+    }
+    pairwise_job_t job = {.ballots = ballots, .weights = weights};
+    job.chunk = (nb + PAIRWISE_CHUNKS - 1) / PAIRWISE_CHUNKS;
+    if(job.chunk < 1) {
+        job.chunk = 1;
+    }
+    int ntasks = (nb + job.chunk - 1) / job.chunk;
+    job.partial = malloc(sizeof(long *) * nthreads);
+    job.ranked = malloc(sizeof(long *) * nthreads);
+    for(int t = 0; t < nthreads; t++) {
+        job.partial[t] = calloc((long) n * n, sizeof(long));
+        job.ranked[t] = calloc(n, sizeof(long));
+    }
+    rcv_pool_run(nthreads, ntasks, pairwise_task, &job);
+
+    long *matrix = calloc((long) n * n + 1, sizeof(long));
+    for(int t = 0; t < nthreads; t++) {
+        for(int a = 0; a < n; a++) {
+            long *row = matrix + (long) a * n;
+            const long *part = job.partial[t] + (long) a * n;
+            long base = job.ranked[t][a];
+            for(int b = 0; b < n; b++) {        // branch-free so it vectorizes
+                row[b] += base + part[b];
+            }
+        }
+        free(job.partial[t]);
+        free(job.ranked[t]);
+    }
+    free(job.partial);
+    free(job.ranked);
+    return matrix;
+}
+// Build the n*n pairwise preference matrix of `ballots` in one pass:
+// entry [a*n + b] is the total weight of ballots preferring a to b,
+// where a ranked candidate is preferred to any candidate ranked after
+// it or not ranked at all. `weights` gives the weight of each ballot,
+// e.g. the size of a group of identical ballots, or is NULL for the
+// weight of each vote. Ranges of ballots are counted in parallel on up
+// to `nthreads` threads into per-worker matrices which are then summed.
+// Returns a malloc()'d matrix that the caller must free().
+
+int rcv_condorcet_winner(const long *matrix, int n){
+    for(int a = 0; a < n; a++) {
+        int beats_all = 1;
+        for(int b = 0; b < n && beats_all; b++) {
+            if(b != a && matrix[(long) a * n + b] <= matrix[(long) b * n + a]) {
+                beats_all = 0;
+            }
+        }
+        if(beats_all) {
+            return a;
+        }
+    }
+    return NO_CANDIDATE;
+}
+// Return the candidate preferred to every other candidate by more
+// ballots than prefer the other, or NO_CANDIDATE if there is none.
+
+void rcv_pairwise_print_r(rcv_ctx_t *ctx, tally_t *tally, int nthreads){
+    int n = tally->candidate_count;
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    long *matrix = rcv_pairwise(&ballots, NULL, nthreads);
+
+    fprintf(ctx->out, "PAIRWISE PREFERENCES: ballots preferring row to column\n");
+    fprintf(ctx->out, "NUM");
+    for(int b = 0; b < n; b++) {
+        fprintf(ctx->out, " %6d", b);
+    }
+    fprintf(ctx->out, " NAME\n");
+    for(int a = 0; a < n; a++) {
+        fprintf(ctx->out, "%3d", a);
+        for(int b = 0; b < n; b++) {
+            if(a == b) {
+                fprintf(ctx->out, " %6s", "-");
+            }
+            else {
+                fprintf(ctx->out, " %6ld", matrix[(long) a * n + b]);
+            }
+        }
+        fprintf(ctx->out, " %s\n", tally->candidate_names[a]);
+    }
+
+    int condorcet = rcv_condorcet_winner(matrix, n);
+    rcv_sim_result_t res = {0};
+    rcv_sim_run(&ballots, NULL, NULL, &res, NULL);
+    if(condorcet == NO_CANDIDATE) {
+        fprintf(ctx->out, "No Condorcet winner\n");
+    }
+    else {
+        fprintf(ctx->out, "Condorcet winner: %s (candidate %d)\n",
+                tally->candidate_names[condorcet], condorcet);
+        if(res.condition == TALLY_WINNER && res.winner != condorcet) {
+            fprintf(ctx->out, "WARNING: RCV winner %s (candidate %d) is not the Condorcet winner\n",
+                    tally->candidate_names[res.winner], res.winner);
+        }
+    }
+    free(matrix);
+    rcv_ballots_free(&ballots);
+}
+// Print the pairwise preference matrix of the tally's ballots with one
+// row per candidate, the Condorcet winner if there is one, and a
+// warning when the RCV winner differs from it as happens in a center
+// squeeze. The tally is not changed.
@@ -0,0 +1,137 @@
+// rcv_pool.c: Small work-stealing thread pool used to run independent
+// tabulation tasks (contests, scenarios, samples) concurrently.
+
+#include "rcv.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct {                // Range of task indices owned by one worker
+  pthread_mutex_t lock;         // guards next/end, taken by the owner and by thieves
+  int next;                     // next task index to run
+  int end;                      // one past the last task index owned
+} pool_range_t;
+
+typedef struct {                // State shared by all workers of one rcv_pool_run()
+  int nthreads;
+  pool_range_t *ranges;         // one range per worker
+  rcv_task_fn fn;               // task function run for each index
+  void *arg;                    // passed through to fn
+} pool_t;
+
+typedef struct {
+  pool_t *pool;
+  int worker;
+} pool_worker_t;
+
+int rcv_pool_threads(){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1) {
+        n = 1;
+    }
+    return (int) n;
+}
+// Returns the number of online processors which is the default thread
+// count for all parallel modes.
+
+static int pool_take(pool_range_t *range){
+    int task = -1;
+    pthread_mutex_lock(&range->lock);
+    if(range->next < range->end) {
+        task = range->next++;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return task;
+}
+// Pop the next task from the front of a worker's own range or -1 if
+// the range is empty.
+
+static int pool_steal(pool_t *pool, int thief){
+    for(int i = 1; i < pool->nthreads; i++) {
+        pool_range_t *victim = &pool->ranges[(thief + i) % pool->nthreads];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if(left > 0) {
+            int take = (left + 1) / 2;      // steal the back half, run its first task now
+            int lo = victim->end - take;
+            victim->end = lo;
+            pthread_mutex_unlock(&victim->lock);
+
+            pool_range_t *own = &pool->ranges[thief];
+            pthread_mutex_lock(&own->lock);
+            own->next = lo + 1;
+            own->end = lo + take;
+            pthread_mutex_unlock(&own->lock);
+            return lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return -1;
+}
+// Steal the back half of the first non-empty range of another worker,
+// installing it as the thief's own range. Returns the first stolen
+// task index or -1 when every range is empty and the pool is done.
+
+static void *pool_worker_main(void *arg){
+    pool_worker_t *w = arg;
+    pool_t *pool = w->pool;
+    while(1) {
+        int task = pool_take(&pool->ranges[w->worker]);
+        if(task < 0) {
+            task = pool_steal(pool, w->worker);
+        }
+        if(task < 0) {
+            break;
+        }
+        pool->fn(pool->arg, task, w->worker);
+    }
+    return NULL;
+}
+
+int rcv_pool_run(int nthreads, int ntasks, rcv_task_fn fn, void *arg){
+    if(nthreads < 1) {
+        nthreads = rcv_pool_threads();
+    }
+    if(nthreads > ntasks) {
+        nthreads = ntasks;
+    }
+    if(nthreads <= 1) {                 // no threads needed, run in the caller
+        for(int i = 0; i < ntasks; i++) {
+            fn(arg, i, 0);
+        }
+        return 1;
+    }
+
+    pool_t pool = {.nthreads = nthreads, .fn = fn, .arg = arg};
+    pool.ranges = malloc(sizeof(pool_range_t) * nthreads);
+    pool_worker_t *workers = malloc(sizeof(pool_worker_t) * nthreads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    for(int i = 0; i < nthreads; i++) {   // even initial split, stealing evens out the rest
+        pthread_mutex_init(&pool.ranges[i].lock, NULL);
+        pool.ranges[i].next = (int) ((long) ntasks * i / nthreads);
+        pool.ranges[i].end  = (int) ((long) ntasks * (i + 1) / nthreads);
+        workers[i].pool = &pool;
+        workers[i].worker = i;
+    }
+    for(int i = 1; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, pool_worker_main, &workers[i]);
+    }
+    pool_worker_main(&workers[0]);        // caller acts as worker 0
+    for(int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for(int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.ranges[i].lock);
+    }
+    free(threads);
+    free(workers);
+    free(pool.ranges);
+    return nthreads;
+}
+// Run fn(arg, i, worker) for every task index i in 0..ntasks-1 using
+// up to nthreads threads (rcv_pool_threads() if nthreads < 1); the
+// calling thread participates as worker 0. Task indices are split
+// evenly between workers up front and idle workers steal half of the
+// remaining range of a busy one, so a few slow tasks (large contests)
+// do not serialize the tail of the run. `worker` is in
+// 0..nthreads-1 and may be used to index per-thread scratch space.
+// Returns the number of threads actually used.
@@ -0,0 +1,162 @@
+// rcv_sample.c: Monte Carlo ballot-sampling audit. Re-runs the
+// election on many seeded random resamples of the ballots to estimate
+// how often the winner would change.
+
+#include "rcv.h"
+#include <math.h>
+
+static uint64_t splitmix64(uint64_t *state){
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+// Small, fast generator whose full state is one 64-bit integer so every
+// sample can have its own stream.
+
+static uint64_t sample_below(uint64_t *state, uint64_t bound){
+    return (uint64_t) (((__uint128_t) splitmix64(state) * bound) >> 64);
+}
+// Uniform random integer in 0..bound-1.
+
+typedef struct {                // Arguments shared by all sample tasks
+  rcv_ballots_t *ballots;
+  int mode;                     // RCV_SAMPLE_BOOTSTRAP or RCV_SAMPLE_SUBSET
+  int sample_size;              // ballots drawn per sample
+  int *ends;                    // summed weights of the votes up to each one
+  int total;                    // ballots the votes stand for, ends[ballot_count - 1]
+  uint64_t seed;
+  int **weights;                // per-worker weight vector
+  int **scratch;                // per-worker simulation scratch
+  int *winners;                 // winner of each sample, NO_CANDIDATE for a tie or error
+} sample_job_t;
+
+static void sample_task(void *arg, int i, int worker){
+    sample_job_t *job = arg;
+    int nb = job->ballots->ballot_count;
+    int *weights = job->weights[worker];
+    uint64_t state = job->seed ^ (0xD1B54A32D192ED03ULL * (uint64_t) (i + 1));
+    memset(weights, 0, sizeof(int) * nb);
+
+    if(job->mode == RCV_SAMPLE_BOOTSTRAP) {     // total draws with replacement
+        for(int k = 0; k < job->sample_size; k++) {
+            int u = sample_below(&state, job->total);
+            int lo = 0, hi = nb - 1;            // first vote whose ballots reach past u
+            while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(job->ends[mid] > u) {
+                    hi = mid;
+                }
+                else {
+                    lo = mid + 1;
+                }
+            }
+            weights[lo]++;
+        }
+    }
+    else {                                      // selection sampling without replacement
+        int need = job->sample_size, seen = 0;
+        for(int b = 0; b < nb && need > 0; b++) {
+            for(int w = job->ballots->ballots[b]->weight; w > 0 && need > 0; w--, seen++) {
+                if(sample_below(&state, job->total - seen) < (uint64_t) need) {
+                    weights[b]++;
+                    need--;
+                }
+            }
+        }
+    }
+
+    rcv_sim_result_t result = {0};
+    rcv_sim_run(job->ballots, NULL, weights, &result, job->scratch[worker]);
+    job->winners[i] = result.condition == TALLY_WINNER ? result.winner : NO_CANDIDATE;
+}
+// Draw sample i as a weight vector over the shared ballots and run the
+// election on it. Draws are of single ballots, a vote of weight w
+// counting as w ballots. The generator is seeded from the audit seed
+// and the sample index alone, so each sample is the same whichever
+// thread runs it and results do not depend on the thread count.
+
+void rcv_montecarlo_r(rcv_ctx_t *ctx, tally_t *tally, int samples, int mode,
+                      double fraction, uint64_t seed, int nthreads){
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    int nb = ballots.ballot_count;
+    int n = tally->candidate_count;
+    int *ends = malloc(sizeof(int) * (nb + 1));
+    int total = 0;
+    for(int b = 0; b < nb; b++) {
+        total += ballots.ballots[b]->weight;
+        ends[b] = total;
+    }
+
+    rcv_sim_result_t actual = {0};
+    rcv_sim_run(&ballots, NULL, NULL, &actual, NULL);
+
+    if(nthreads < 1) {
+        nthreads = rcv_pool_threads();
+    }
+    sample_job_t job = {.ballots = &ballots, .mode = mode, .seed = seed, .ends = ends, .total = total};
+    job.sample_size = mode == RCV_SAMPLE_BOOTSTRAP ? total : (int) (fraction * total + 0.5);
+    job.weights = malloc(sizeof(int *) * nthreads);
+    job.scratch = malloc(sizeof(int *) * nthreads);
+    for(int t = 0; t < nthreads; t++) {
+        job.weights[t] = malloc(sizeof(int) * (nb + 1));
+        job.scratch[t] = malloc(sizeof(int) * 2 * (nb + 1));
+    }
+    job.winners = malloc(sizeof(int) * (samples + 1));
+    rcv_pool_run(nthreads, samples, sample_task, &job);
+
+    int wins[MAX_CANDIDATES] = {0};
+    int ties = 0, changed = 0;
+    for(int i = 0; i < samples; i++) {
+        if(job.winners[i] == NO_CANDIDATE) {
+            ties++;
+        }
+        else {
+            wins[job.winners[i]]++;
+        }
+        if(job.winners[i] != actual.winner) {
+            changed++;
+        }
+    }
+
+    fprintf(ctx->out, "MONTE CARLO AUDIT: %d %s samples of %d of %d ballots, seed %llu\n",
+            samples, mode == RCV_SAMPLE_BOOTSTRAP ? "bootstrap" : "subset",
+            job.sample_size, total, (unsigned long long) seed);
+    fprintf(ctx->out, "NUM   WINS %%PROB   +/- NAME\n");
+    for(int c = 0; c < n; c++) {
+        double p = samples > 0 ? (double) wins[c] / samples : 0.0;
+        double err = samples > 0 ? 196.0 * sqrt(p * (1 - p) / samples) : 0.0;
+        fprintf(ctx->out, "%3d %6d %5.1f %5.1f %s\n", c, wins[c], 100 * p, err, tally->candidate_names[c]);
+    }
+    fprintf(ctx->out, "Ties or errors: %d\n", ties);
+    if(actual.condition == TALLY_WINNER) {
+        fprintf(ctx->out, "Reported winner %s changed in %d of %d samples (%.1f%%)\n",
+                tally->candidate_names[actual.winner], changed, samples,
+                samples > 0 ? 100.0 * changed / samples : 0.0);
+    }
+    else {
+        fprintf(ctx->out, "Reported result is a tie; a single winner emerged in %d of %d samples\n",
+                changed, samples);
+    }
+
+    for(int t = 0; t < nthreads; t++) {
+        free(job.weights[t]);
+        free(job.scratch[t]);
+    }
+    free(job.weights);
+    free(job.scratch);
+    free(job.winners);
+    free(ends);
+    rcv_ballots_free(&ballots);
+}
+// Estimate how stable the election result is by re-running it on
+// `samples` random resamples of the ballots in parallel on up to
+// `nthreads` threads. With RCV_SAMPLE_BOOTSTRAP each sample draws as
+// many ballots as there are, with replacement; with RCV_SAMPLE_SUBSET
+// each sample is a random `fraction` of the ballots without
+// replacement. Samples are weight vectors over the shared ballots so no
+// ballot is copied. Prints, for each candidate, the number and
+// percentage of samples they won with a 95% confidence half-width,
+// then how often the reported winner changed. Output for a given seed
+// is identical on any number of threads. The tally is not changed.
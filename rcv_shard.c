@@ -0,0 +1,143 @@
+// rcv_shard.c: Loading an election split into several per-precinct
+// vote files ("shards") which share the same candidate header.
+
+#include "rcv.h"
+
+typedef struct {                // Arguments shared by all shard loading tasks
+  rcv_ctx_t *ctx;               // parent context supplying log level and allocator
+  char **fnames;                // shard file names
+  tally_t **tallies;            // loaded tally for each shard or NULL on failure
+  long *vote_counts;            // ballots read from each shard, skipped ones included
+  rcv_stats_t *stats;           // stats of each shard load
+  char **logs;                  // buffered output of each shard load
+  size_t *log_lens;
+} shard_job_t;
+
+static void shard_task(void *arg, int i, int worker){
+    shard_job_t *job = arg;
+    rcv_ctx_t ctx = *job->ctx;
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+    ctx.out = open_memstream(&job->logs[i], &job->log_lens[i]);
+    job->tallies[i] = tally_from_file_r(&ctx, job->fnames[i]);
+    job->vote_counts[i] = tally_ballots_read(&ctx);
+    job->stats[i] = ctx.stats;
+    fclose(ctx.out);
+}
+// Parse one shard with a private copy of the context whose output is
+// buffered so that shard logs can be emitted in order afterwards.
+
+static int shard_header_matches(tally_t *a, tally_t *b){
+    if(a->candidate_count != b->candidate_count) {
+        return 0;
+    }
+    for(int i = 0; i < a->candidate_count; i++) {
+        if(strcmp(a->candidate_names[i], b->candidate_names[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static vote_t *shard_splice(vote_t *list, vote_t *rest, int id_offset){
+    if(list == NULL) {
+        return rest;
+    }
+    vote_t *tail = list;
+    while(1) {
+        tail->id += id_offset;
+        if(tail->next == NULL) {
+            break;
+        }
+        tail = tail->next;
+    }
+    tail->next = rest;
+    return list;
+}
+// Renumber the votes in `list` by `id_offset` and link `rest` after its
+// last vote. Returns the head of the combined list.
+
+tally_t *tally_from_shards_r(rcv_ctx_t *ctx, char **fnames, int count, int nthreads){
+    shard_job_t job = {.ctx = ctx, .fnames = fnames};
+    job.tallies = calloc(count, sizeof(tally_t *));
+    job.vote_counts = calloc(count, sizeof(long));
+    job.stats = calloc(count, sizeof(rcv_stats_t));
+    job.logs = calloc(count, sizeof(char *));
+    job.log_lens = calloc(count, sizeof(size_t));
+    rcv_pool_run(nthreads, count, shard_task, &job);
+
+    tally_t *tally = NULL;
+    int ok = count > 0;
+    for(int i = 0; i < count; i++) {     // logs in shard order, then check headers
+        fwrite(job.logs[i], 1, job.log_lens[i], ctx->out);
+        free(job.logs[i]);
+        if(ok && job.tallies[i] == NULL) {
+            ok = 0;
+        }
+        else if(ok && !shard_header_matches(job.tallies[0], job.tallies[i])) {
+            fprintf(ctx->out, "ERROR: shard '%s' candidates do not match shard '%s'\n",
+                    fnames[i], fnames[0]);
+            ok = 0;
+        }
+    }
+
+    if(ok) {
+        // Later shards go in front so lists match loading the
+        // concatenated file, where the newest vote is at the front.
+        tally = job.tallies[0];
+        long offset = job.vote_counts[0];
+        for(int i = 1; i < count; i++) {
+            tally_t *shard = job.tallies[i];
+            for(int c = 0; c < tally->candidate_count; c++) {
+                tally->candidate_votes[c] = shard_splice(shard->candidate_votes[c],
+                                                         tally->candidate_votes[c], offset);
+                tally->candidate_vote_counts[c] += shard->candidate_vote_counts[c];
+                shard->candidate_votes[c] = NULL;
+            }
+            tally->invalid_votes = shard_splice(shard->invalid_votes, tally->invalid_votes, offset);
+            tally->invalid_vote_count += shard->invalid_vote_count;
+            shard->invalid_votes = NULL;
+            offset += job.vote_counts[i];
+            tally_free_r(ctx, shard);
+        }
+        for(int i = 0; i < count; i++) {
+            ctx->stats.votes_added += job.stats[i].votes_added;
+            for(int r = 0; r < BALLOT_REASONS; r++) {
+                ctx->stats.bad_ballots[r] += job.stats[i].bad_ballots[r];
+            }
+        }
+    }
+    else {
+        for(int i = 0; i < count; i++) {
+            if(job.tallies[i] != NULL) {
+                tally_free_r(ctx, job.tallies[i]);
+            }
+        }
+    }
+
+    free(job.tallies);
+    free(job.vote_counts);
+    free(job.stats);
+    free(job.logs);
+    free(job.log_lens);
+    return tally;
+}
+// Load an election from `count` shard files which each have the same
+// candidate count and names followed by votes. Shards are parsed in
+// parallel on up to `nthreads` threads, each into its own tally, with
+// log output buffered per shard and written to ctx->out in shard
+// order. The shard tallies are then merged by splicing their vote
+// lists together; votes are renumbered so that ids are globally
+// unique and identical to loading the shards concatenated in order,
+// which makes results independent of thread scheduling. The context's
+// allocator must be thread-safe.
+//
+// ERROR CASES: If any shard can't be opened (the usual "ERROR:
+// couldn't open file" message is printed) or a shard's candidates
+// differ from the first shard's, which prints
+// "ERROR: shard 'XX' candidates do not match shard 'YY'"
+// all shard tallies are de-allocated and NULL is returned.
+
+tally_t *tally_from_shards(char **fnames, int count){
+    rcv_ctx_t ctx = rcv_ctx_global();
+    return tally_from_shards_r(&ctx, fnames, count, 0);
+}
@@ -0,0 +1,180 @@
+// rcv_shm.c: Publication of an election's latest round table in a
+// POSIX shared memory region so any number of reader processes can
+// poll it without locks or file I/O.
+//
+// The region holds one rcv_shm_table_t guarded by a sequence counter
+// in the style of a seqlock: the single writer makes the counter odd,
+// updates the table then makes it even again, and a reader copies the
+// table between two reads of the counter, retrying if the counter was
+// odd or changed, so it never sees a half-written round.
+
+#include "rcv.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RCV_SHM_MAGIC 0x52435654        // "RCVT"
+
+struct rcv_shm {                // Region being published to, see rcv_shm_open_r()
+  rcv_shm_table_t *table;       // the shared mapping
+};
+
+static void shm_name(char *dest, size_t size, char *name){
+    snprintf(dest, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+// Region names passed to shm_open() must start with a slash.
+
+static void shm_publish(rcv_shm_table_t *table, tally_t *tally, int round){
+    uint64_t seq = table->seq;
+    __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // odd counter visible before any data
+    int n = tally->candidate_count;
+    table->magic = RCV_SHM_MAGIC;
+    table->candidate_count = n;
+    table->round = round;
+    table->condition = tally_condition(tally);
+    table->winner = NO_CANDIDATE;
+    for(int c = 0; c < n; c++) {
+        table->counts[c] = tally->candidate_vote_counts[c];
+        table->status[c] = tally->candidate_status[c];
+        if(table->condition == TALLY_WINNER && tally->candidate_status[c] == CAND_ACTIVE) {
+            table->winner = c;
+        }
+    }
+    table->invalid_vote_count = tally->invalid_vote_count;
+    __atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);   // data visible before even counter
+}
+// Write the state of `tally` at the end of `round` as one seqlock
+// update. Only one process may publish to a region.
+
+static void shm_round(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    rcv_shm_t *shm = arg;
+    shm_publish(shm->table, tally, round);
+}
+// Round hook publishing the end of each round.
+
+rcv_shm_t *rcv_shm_open_r(rcv_ctx_t *ctx, tally_t *tally, char *name){
+    char path[NAME_MAX + 2];
+    shm_name(path, sizeof(path), name);
+    int fd = shm_open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0 || ftruncate(fd, sizeof(rcv_shm_table_t)) != 0) {
+        fprintf(ctx->out, "ERROR: couldn't create shared memory '%s'\n", path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    rcv_shm_table_t *table = mmap(NULL, sizeof(rcv_shm_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(table == MAP_FAILED) {
+        fprintf(ctx->out, "ERROR: couldn't map shared memory '%s'\n", path);
+        return NULL;
+    }
+    rcv_shm_t *shm = malloc(sizeof(rcv_shm_t));
+    shm->table = table;
+    if(!rcv_ctx_add_round_hook(ctx, shm_round, shm)) {
+        rcv_shm_close_r(ctx, shm);
+        return NULL;
+    }
+    uint64_t seq = table->seq | 1;              // names are written inside an update too
+    __atomic_store_n(&table->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(int c = 0; c < tally->candidate_count; c++) {
+        memcpy(table->names[c], tally->candidate_names[c], MAX_NAME);
+    }
+    __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELEASE);
+    shm_publish(table, tally, 0);
+    return shm;
+}
+// Create or reuse shared memory region `name` and publish the freshly
+// loaded `tally` to it as round 0, then register a round hook on `ctx`
+// publishing the counts, statuses and condition at the end of every
+// round of the election about to be run. The region outlives the
+// process so readers can still see the final round; remove it with
+// rcv_shm_unlink(). Prints an error and returns NULL if the region
+// can't be created or the context has no room for more hooks.
+
+void rcv_shm_close_r(rcv_ctx_t *ctx, rcv_shm_t *shm){
+    munmap(shm->table, sizeof(rcv_shm_table_t));
+    free(shm);
+}
+// Unmap a published region, leaving its last round in place. The hook
+// stays registered in the context so it must not run another election.
+
+const rcv_shm_table_t *rcv_shm_attach(char *name){
+    char path[NAME_MAX + 2];
+    shm_name(path, sizeof(path), name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *table = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(rcv_shm_table_t)) {
+        table = mmap(NULL, sizeof(rcv_shm_table_t), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return table == MAP_FAILED ? NULL : table;
+}
+// Map region `name` read-only for repeated rcv_shm_snapshot() calls.
+// Returns NULL if it doesn't exist or is too small to be a round table.
+
+int rcv_shm_snapshot(const rcv_shm_table_t *shared, rcv_shm_table_t *copy){
+    for(int tries = 0; tries < 1000000; tries++) {
+        uint64_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {                           // update in progress
+            continue;
+        }
+        memcpy(copy, (const void *) shared, sizeof(rcv_shm_table_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);    // copy done before the counter is re-read
+        if(__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq) {
+            copy->seq = seq;
+            return copy->magic == RCV_SHM_MAGIC &&
+                   copy->candidate_count >= 0 && copy->candidate_count <= MAX_CANDIDATES;
+        }
+    }
+    return 0;
+}
+// Take a consistent copy of a published table without blocking the
+// writer, retrying while an update is in progress. Returns 0 if nothing
+// has been published or the writer is stuck mid-update.
+
+void rcv_shm_detach(const rcv_shm_table_t *shared){
+    munmap((void *) shared, sizeof(rcv_shm_table_t));
+}
+
+int rcv_shm_unlink(char *name){
+    char path[NAME_MAX + 2];
+    shm_name(path, sizeof(path), name);
+    return shm_unlink(path) == 0;
+}
+// Remove region `name`; readers which have it mapped keep their view.
+
+void rcv_shm_print_r(rcv_ctx_t *ctx, const rcv_shm_table_t *table){
+    tally_t *shown = calloc(1, sizeof(tally_t));
+    shown->candidate_count = table->candidate_count;
+    for(int c = 0; c < table->candidate_count; c++) {
+        memcpy(shown->candidate_names[c], table->names[c], MAX_NAME);
+        shown->candidate_names[c][MAX_NAME - 1] = '\0';
+        shown->candidate_vote_counts[c] = table->counts[c];
+        shown->candidate_status[c] = table->status[c] == CAND_MINVOTES ? CAND_ACTIVE : table->status[c];
+    }
+    shown->invalid_vote_count = table->invalid_vote_count;
+    if(table->round > 0) {
+        fprintf(ctx->out, "=== ROUND %d ===\n", table->round);
+    }
+    tally_print_table_r(ctx, shown);
+    for(int c = 0; c < table->candidate_count; c++) {
+        shown->candidate_status[c] = table->status[c];
+    }
+    if(table->condition == TALLY_WINNER || table->condition == TALLY_TIE) {
+        rcv_ctx_t copy = *ctx;                  // leaves ctx->stats alone
+        tally_print_result_r(&copy, shown);
+    }
+    free(shown);
+}
+// Print a snapshot as the election printed its round: the headline,
+// except for round 0, and the table with candidates marked at the end
+// of the round shown as active, followed by the winner or tie once the
+// election is over.
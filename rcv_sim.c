@@ -0,0 +1,249 @@
+// rcv_sim.c: Array-based election engine for running many scenarios
+// over one shared, read-only set of ballots. Where tally_election()
+// moves vote_t structs between lists and changes their pos field,
+// each simulation keeps its own pos/pile arrays and counts so that
+// any number of them may run at once on different threads.
+
+#include "rcv.h"
+
+static int ballot_id_cmp(const void *a, const void *b){
+    const vote_t *va = *(vote_t * const *) a, *vb = *(vote_t * const *) b;
+    return (va->id > vb->id) - (va->id < vb->id);
+}
+
+void rcv_ballots_init(rcv_ballots_t *ballots, tally_t *tally){
+    int n = tally->candidate_count;
+    int total = 0;
+    for(int c = 0; c <= n; c++) {
+        vote_t *vote = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        for(; vote != NULL; vote = vote->next) {
+            total++;
+        }
+    }
+    ballots->candidate_count = n;
+    ballots->ballot_count = total;
+    ballots->ballots = malloc(sizeof(vote_t *) * (total + 1));
+    int k = 0;
+    for(int c = 0; c <= n; c++) {
+        vote_t *vote = c < n ? tally->candidate_votes[c] : tally->invalid_votes;
+        for(; vote != NULL; vote = vote->next) {
+            ballots->ballots[k++] = vote;
+        }
+    }
+    qsort(ballots->ballots, total, sizeof(vote_t *), ballot_id_cmp);
+}
+// Gather every vote of the tally, including invalid votes, into an
+// array ordered by id. Only the candidate_order[] and weight of each
+// vote are used by simulations so the tally may be run or freed only
+// after all simulations using the ballots are done.
+
+int rcv_ballots_find(const rcv_ballots_t *ballots, int id){
+    int lo = 0, hi = ballots->ballot_count;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(ballots->ballots[mid]->id < id) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo < ballots->ballot_count && ballots->ballots[lo]->id == id ? lo : -1;
+}
+// Binary search the id ordered `ballots` for the vote with `id`.
+// Returns its index or -1 if there is none: ids are positions in the
+// vote file, so those of ballots skipped by validation are missing.
+
+void rcv_ballots_free(rcv_ballots_t *ballots){
+    free(ballots->ballots);
+    ballots->ballots = NULL;
+}
+// De-allocate the ballot array; the votes belong to the tally.
+
+static int ranking_cmp(const vote_t *va, const vote_t *vb){
+    for(int p = 0; p < MAX_CANDIDATES; p++) {
+        if(va->candidate_order[p] != vb->candidate_order[p]) {
+            return va->candidate_order[p] < vb->candidate_order[p] ? -1 : 1;
+        }
+        if(va->candidate_order[p] == NO_CANDIDATE) {
+            break;                              // later rankings are never reached
+        }
+    }
+    return 0;
+}
+// Order votes by their rankings as far as an election can read them.
+
+static int ballot_ranking_cmp(const void *a, const void *b){
+    const vote_t *va = *(vote_t * const *) a, *vb = *(vote_t * const *) b;
+    int cmp = ranking_cmp(va, vb);
+    return cmp != 0 ? cmp : (va->id > vb->id) - (va->id < vb->id);
+}
+
+void rcv_ballots_print_aggregated_r(rcv_ctx_t *ctx, tally_t *tally){
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    int n = ballots.candidate_count;
+    qsort(ballots.ballots, ballots.ballot_count, sizeof(vote_t *), ballot_ranking_cmp);
+    fprintf(ctx->out, "%d\n", n);
+    for(int c = 0; c < n; c++) {
+        fprintf(ctx->out, "%s%s", tally->candidate_names[c], c < n - 1 ? " " : "\n");
+    }
+    for(int b = 0; b < ballots.ballot_count; ) {
+        vote_t *vote = ballots.ballots[b];
+        long weight = 0;
+        for(; b < ballots.ballot_count && ranking_cmp(ballots.ballots[b], vote) == 0; b++) {
+            weight += ballots.ballots[b]->weight;
+        }
+        fprintf(ctx->out, "%ld:", weight);
+        for(int p = 0; p < n; p++) {
+            fprintf(ctx->out, " %d", vote->candidate_order[p]);
+        }
+        fprintf(ctx->out, "\n");
+    }
+    rcv_ballots_free(&ballots);
+}
+// Print the votes of freshly loaded `tally` as a pre-aggregated vote
+// file: the header, then one line per distinct ranking, in ranking
+// order, giving the summed weight of the votes with it, e.g.
+//
+// 25: 0 3 2 1
+//
+// Loading the result gives the same round counts with one vote per
+// distinct ranking instead of one per ballot.
+
+static int sim_next(vote_t *vote, int pos, char *status, int n){
+    for(pos++; pos < n && vote->candidate_order[pos] != NO_CANDIDATE; pos++) {
+        if(status[vote->candidate_order[pos]] == CAND_ACTIVE) {
+            return pos;
+        }
+    }
+    return -1;
+}
+// Position of the next ACTIVE candidate after `pos` in the vote's
+// order or -1 if there is none, as vote_next_candidate() would move.
+
+static int sim_condition(char *status, int n){
+    tally_t t;
+    t.candidate_count = n;
+    memcpy(t.candidate_status, status, n);
+    return tally_condition(&t);
+}
+
+int rcv_sim_run(const rcv_ballots_t *ballots, const char *init_status, const int *weights,
+                rcv_sim_result_t *result, int *scratch){
+    int n = ballots->candidate_count;
+    int nb = ballots->ballot_count;
+    int *own = NULL;
+    if(scratch == NULL) {
+        own = scratch = malloc(sizeof(int) * 2 * (nb + 1));
+    }
+    int *pos = scratch;                         // pos of each ballot, -1 once exhausted
+    int *next = scratch + nb;                   // next ballot in the same pile
+    int head[MAX_CANDIDATES];                   // first ballot of each candidate's pile
+    int counts[MAX_CANDIDATES];
+    char status[MAX_CANDIDATES];
+    for(int c = 0; c < n; c++) {
+        head[c] = -1;
+        counts[c] = 0;
+        status[c] = init_status == NULL ? CAND_ACTIVE : init_status[c];
+    }
+
+    // Place each ballot with its first ranked candidate not already dropped
+    for(int b = nb - 1; b >= 0; b--) {
+        int w = weights == NULL ? ballots->ballots[b]->weight : weights[b];
+        pos[b] = -1;
+        if(w == 0) {
+            continue;
+        }
+        vote_t *vote = ballots->ballots[b];
+        for(int p = 0; p < n && vote->candidate_order[p] != NO_CANDIDATE; p++) {
+            if(status[vote->candidate_order[p]] != CAND_DROPPED) {
+                int c = vote->candidate_order[p];
+                pos[b] = p;
+                next[b] = head[c];
+                head[c] = b;
+                counts[c] += w;
+                break;
+            }
+        }
+    }
+
+    int round = 0;
+    while(sim_condition(status, n) == TALLY_CONTINUE) {
+        round++;
+        for(int c = 0; c < n; c++) {            // drop MINVOTES candidates
+            if(status[c] != CAND_MINVOTES) {
+                continue;
+            }
+            for(int b = head[c]; b != -1; ) {
+                int following = next[b];
+                int w = weights == NULL ? ballots->ballots[b]->weight : weights[b];
+                vote_t *vote = ballots->ballots[b];
+                pos[b] = sim_next(vote, pos[b], status, n);
+                if(pos[b] >= 0) {
+                    int to = vote->candidate_order[pos[b]];
+                    next[b] = head[to];
+                    head[to] = b;
+                    counts[to] += w;
+                }
+                b = following;
+            }
+            head[c] = -1;
+            counts[c] = 0;
+            status[c] = CAND_DROPPED;
+        }
+
+        int min = INT_MAX;                      // same rule as tally_set_minvote_candidates()
+        for(int c = 0; c < n; c++) {
+            if(status[c] != CAND_DROPPED && counts[c] < min) {
+                min = counts[c];
+            }
+        }
+        if(result->round_counts != NULL) {
+            memcpy(result->round_counts[round], counts, sizeof(int) * n);
+        }
+        for(int c = 0; c < n; c++) {
+            if(counts[c] == min) {
+                status[c] = CAND_MINVOTES;
+            }
+        }
+        if(result->round_status != NULL) {
+            memcpy(result->round_status[round], status, n);
+        }
+    }
+
+    result->rounds = round;
+    result->condition = sim_condition(status, n);
+    result->winner = NO_CANDIDATE;
+    if(result->condition == TALLY_WINNER) {
+        for(int c = 0; c < n; c++) {
+            if(status[c] == CAND_ACTIVE) {
+                result->winner = c;
+            }
+        }
+    }
+    memcpy(result->final_counts, counts, sizeof(int) * n);
+    memcpy(result->final_status, status, n);
+    free(own);
+    return result->condition;
+}
+// Run an election over `ballots` without modifying them, following
+// the same rounds as tally_election(): drop the MINVOTES candidates,
+// moving each of their ballots to its next ACTIVE candidate, then mark
+// the new minimum. Ballots whose next choice runs out are exhausted and
+// no longer counted.
+//
+// `init_status` gives each candidate's status before round 1 or is
+// NULL for all ACTIVE; ballots start with their first ranked candidate
+// who is not CAND_DROPPED so that excluded candidates can be set
+// DROPPED here. `weights` gives the multiplicity of each ballot (0 to
+// leave it out), replacing the weight of its vote, or is NULL to use
+// the vote weights. `scratch` is space for
+// 2*ballot_count ints private to this run or NULL to allocate it.
+//
+// Fills in the condition, winner (NO_CANDIDATE unless TALLY_WINNER),
+// round count and final counts and statuses of `result`. If
+// result->round_counts / round_status are not NULL they must have
+// room for MAX_CANDIDATES+1 rows and receive each round's counts and
+// the statuses after its MINVOTES marking at row `round`. Returns the
+// final condition.
@@ -0,0 +1,140 @@
+// rcv_transfer.c: Per-round transfer reports: how many votes moved
+// from each dropped candidate to each other candidate or were
+// exhausted, accumulated as transfers happen.
+
+#include "rcv.h"
+
+static void transfer_count(rcv_ctx_t *ctx, tally_t *tally, vote_t *vote, int from, int to, void *arg){
+    rcv_transfers_t *tr = arg;
+    int col = to == NO_CANDIDATE ? tr->candidate_count : to;
+    tr->counts[from * (tr->candidate_count + 1) + col] += vote->weight;
+}
+// Transfer hook adding the weight of one vote to the matrix cell
+// [from][to], with column candidate_count for votes moved to the
+// invalid votes.
+
+static void transfer_csv_name(FILE *out, char *name){
+    fputc('"', out);
+    for(char *p = name; *p != '\0'; p++) {
+        if(*p == '"') {
+            fputc('"', out);                    // a quote is doubled
+        }
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+// Write a candidate name as a quoted CSV field so names holding commas
+// or quotes, as CVR headers may, stay one field.
+
+static void transfer_json_name(FILE *out, char *name){
+    fputc('"', out);
+    for(unsigned char *p = (unsigned char *) name; *p != '\0'; p++) {
+        if(*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        }
+        else if(*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+// Write a candidate name as a JSON string, escaping quotes,
+// backslashes and control characters.
+
+static void transfer_write_round(rcv_ctx_t *ctx, tally_t *tally, int round, void *arg){
+    rcv_transfers_t *tr = arg;
+    int n = tr->candidate_count;
+    for(int from = 0; from < n; from++) {
+        if(tally->candidate_status[from] != CAND_DROPPED || tr->dropped[from]) {
+            continue;                           // only candidates dropped this round
+        }
+        tr->dropped[from] = 1;
+        long *row = tr->counts + from * (n + 1);
+        if(tr->format == RCV_TRANSFERS_CSV) {
+            fprintf(tr->out, "%d,", round);
+            transfer_csv_name(tr->out, tally->candidate_names[from]);
+            for(int to = 0; to <= n; to++) {
+                fprintf(tr->out, ",%ld", row[to]);
+            }
+            fprintf(tr->out, "\n");
+        }
+        else {
+            fprintf(tr->out, "%s\n  {\"round\": %d, \"from\": ", tr->rows_written > 0 ? "," : "", round);
+            transfer_json_name(tr->out, tally->candidate_names[from]);
+            fprintf(tr->out, ", \"to\": {");
+            for(int to = 0; to < n; to++) {
+                transfer_json_name(tr->out, tally->candidate_names[to]);
+                fprintf(tr->out, ": %ld, ", row[to]);
+            }
+            fprintf(tr->out, "\"exhausted\": %ld}}", row[n]);
+        }
+        tr->rows_written++;
+        memset(row, 0, sizeof(long) * (n + 1));
+    }
+}
+// Round hook writing one row per candidate dropped during `round`,
+// i.e. now DROPPED but not yet reported, then clearing the row so the
+// matrix only ever holds the current round's transfers.
+
+rcv_transfers_t *rcv_transfers_open_r(rcv_ctx_t *ctx, tally_t *tally, FILE *out, int format){
+    int n = tally->candidate_count;
+    rcv_transfers_t *tr = calloc(1, sizeof(rcv_transfers_t));
+    tr->candidate_count = n;
+    tr->format = format;
+    tr->out = out;
+    tr->counts = calloc(n * (n + 1) + 1, sizeof(long));
+    for(int c = 0; c < n; c++) {
+        tr->dropped[c] = tally->candidate_status[c] == CAND_DROPPED;
+    }
+    if(!rcv_ctx_add_transfer_hook(ctx, transfer_count, tr) ||
+       !rcv_ctx_add_round_hook(ctx, transfer_write_round, tr)) {
+        free(tr->counts);
+        free(tr);
+        return NULL;
+    }
+    if(format == RCV_TRANSFERS_CSV) {
+        fprintf(out, "round,from");
+        for(int c = 0; c < n; c++) {
+            fputc(',', out);
+            transfer_csv_name(out, tally->candidate_names[c]);
+        }
+        fprintf(out, ",exhausted\n");
+    }
+    else {
+        fprintf(out, "[");
+    }
+    return tr;
+}
+// Start a transfer report on `out` for the election about to be run
+// on `tally` with `ctx` by registering a transfer hook, which counts
+// each moved vote into a from x to matrix with a final exhausted
+// column, and a round hook, which writes the rows of candidates
+// dropped in that round. `format` is RCV_TRANSFERS_CSV, giving a
+// header line then one line per dropped candidate
+//
+//   round,from,"Francis","Claire","Heather","Viktor",exhausted
+//   2,"Viktor",1,0,0,0,0
+//
+// or RCV_TRANSFERS_JSON, giving an array of objects
+//
+//   {"round": 2, "from": "Viktor", "to": {"Francis": 1, ..., "exhausted": 0}}
+//
+// Candidates dropped in the same round get one row each. Memory use is
+// one candidate_count x (candidate_count+1) matrix however many votes
+// move. Returns NULL if the context has no room for more hooks.
+
+void rcv_transfers_close_r(rcv_ctx_t *ctx, rcv_transfers_t *tr){
+    if(tr->format == RCV_TRANSFERS_JSON) {
+        fprintf(tr->out, "\n]\n");
+    }
+    fflush(tr->out);
+    free(tr->counts);
+    free(tr);
+}
+// Finish the report, closing the JSON array if needed, and
+// de-allocate it. The hooks stay registered in the context so the
+// context must not run another election afterwards. Does not close
+// the output stream.
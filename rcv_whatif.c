@@ -0,0 +1,64 @@
+// rcv_whatif.c: "Who wins if candidate X had not run" for every
+// candidate X, each scenario run in parallel over shared ballots.
+
+#include "rcv.h"
+
+typedef struct {                // Arguments shared by all exclusion scenarios
+  rcv_ballots_t *ballots;
+  rcv_sim_result_t *results;    // result of each scenario, index 0 excludes nobody
+} whatif_job_t;
+
+static void whatif_task(void *arg, int i, int worker){
+    whatif_job_t *job = arg;
+    char status[MAX_CANDIDATES];
+    for(int c = 0; c < job->ballots->candidate_count; c++) {
+        status[c] = CAND_ACTIVE;
+    }
+    if(i > 0) {
+        status[i - 1] = CAND_DROPPED;
+    }
+    rcv_sim_run(job->ballots, status, NULL, &job->results[i], NULL);
+}
+// Scenario i excludes candidate i-1 by marking them CAND_DROPPED
+// before round 1 in a private status array; scenario 0 is the actual
+// election for comparison.
+
+void rcv_whatif_r(rcv_ctx_t *ctx, tally_t *tally, int nthreads){
+    int n = tally->candidate_count;
+    rcv_ballots_t ballots;
+    rcv_ballots_init(&ballots, tally);
+    whatif_job_t job = {.ballots = &ballots};
+    job.results = calloc(n + 1, sizeof(rcv_sim_result_t));
+    rcv_pool_run(nthreads, n + 1, whatif_task, &job);
+
+    fprintf(ctx->out, "%-24s %-24s %6s\n", "EXCLUDED", "WINNER", "ROUNDS");
+    for(int i = 0; i <= n; i++) {
+        rcv_sim_result_t *res = &job.results[i];
+        char excluded[MAX_NAME + 16], winner[MAX_NAME + 16];
+        if(i == 0) {
+            snprintf(excluded, sizeof(excluded), "(none)");
+        }
+        else {
+            snprintf(excluded, sizeof(excluded), "%d %s", i - 1, tally->candidate_names[i - 1]);
+        }
+        if(res->condition == TALLY_WINNER) {
+            snprintf(winner, sizeof(winner), "%d %s", res->winner, tally->candidate_names[res->winner]);
+        }
+        else if(res->condition == TALLY_TIE) {
+            snprintf(winner, sizeof(winner), "Multiway Tie");
+        }
+        else {
+            snprintf(winner, sizeof(winner), "Error");
+        }
+        fprintf(ctx->out, "%-24s %-24s %6d\n", excluded, winner, res->rounds);
+    }
+    free(job.results);
+    rcv_ballots_free(&ballots);
+}
+// Print a table giving the winner and round count of the election
+// with each candidate excluded in turn, preceded by the actual result
+// with nobody excluded. The ballots are loaded once and shared
+// read-only between scenarios which run on up to `nthreads` threads;
+// each scenario only keeps its own ballot positions and counts. An
+// excluded candidate is treated as CAND_DROPPED from the start so their
+// votes count for the next ranked candidate. The tally is not changed.
@@ -1163,6 +1163,47 @@ int main(int argc, char *argv[]){
     }
   } // ENDTEST
 
+  IF_TEST("tally_snapshot_restore"){
+    // Snapshot a tally right after loading, run the election,
+    // restore the snapshot and check the votes are back in their
+    // original lists and positions, then run the election again
+    // which should print the same rounds and winner.
+    tally_t *t = tally_from_file("data/votes-sample-small.txt");
+    tally_snapshot_t *snap = tally_snapshot(t);
+    printf("CASE 1: first election\n");
+    tally_election(t);
+    tally_restore(snap);
+    printf("\nCASE 2: restored tally\n");
+    tally_print_table(t);
+    tally_print_votes(t);
+    printf("\nCASE 3: second election\n");
+    tally_election(t);
+    tally_snapshot_free(snap);
+    tally_free(t);
+  } // ENDTEST
+
+  IF_TEST("tally_election_r_memstream"){
+    // Run an election through the reentrant API with its output
+    // going to an in-memory stream rather than stdout. Nothing may
+    // reach stdout until the captured text is printed, and the
+    // context's log level must not leak into the global LOG_LEVEL.
+    char *text = NULL;
+    size_t len = 0;
+    rcv_ctx_t ctx;
+    rcv_ctx_init(&ctx);
+    ctx.out = open_memstream(&text, &len);
+    ctx.log_level = LOG_VOTE_TRANSFERS;
+    tally_t *t = tally_from_file_r(&ctx, "data/votes-sample-small.txt");
+    int condition = tally_election_r(&ctx, t);
+    tally_free_r(&ctx, t);
+    fclose(ctx.out);
+    printf("CASE 1: condition %s, global LOG_LEVEL %d, winner %d\n",
+           condition2str(condition), LOG_LEVEL, ctx.stats.winner);
+    printf("\nCASE 2: captured output\n");
+    fwrite(text, 1, len, stdout);
+    free(text);
+  } // ENDTEST
+
   free(tally);
 
   if(nrun == 0){